@@ -1,100 +1,1898 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEXX_X86
+#endif
+
+#define BLOCK_SIZE 0x10000
+#define MAP_WINDOW_SIZE 0x1000000
+#define CHUNK_SIZE 0x40000
+#define MAX_JOBS 256
+#define REVERSE_BLOCK_SIZE 0x100000
+#define MAX_WINDOWS 64
+#define SEARCH_BLOCK_SIZE 0x100000
+#define MAX_PATTERN_SIZE 256
+#define MAX_CONTEXT 4096
+#define ROW_SIZE 16
+#define ROW_TEXT_SIZE ((ROW_SIZE*(2+1))+1+ROW_SIZE+1)
+#define LINE_MAX_SIZE (4+16+4+2+ROW_TEXT_SIZE)
+
+typedef void (*row_kernel)(unsigned char*, size_t, const unsigned char*, size_t);
+typedef bool (*row_decoder)(unsigned char*, const unsigned char*);
+typedef const unsigned char* (*pattern_finder)(const unsigned char*, size_t, const unsigned char*, size_t);
+
+struct hexx_state;
+
+struct hexx_chunk
+{
+	const unsigned char* in;
+	off_t offset;
+	size_t rows;
+	const unsigned char* prev;
+	bool starred;
+
+	unsigned char* out;
+	size_t out_size;
+	bool done;
+};
+
+struct hexx_pool
+{
+	const struct hexx_state* state;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool stop;
+
+	size_t thread_count;
+	pthread_t threads[MAX_JOBS];
+
+	size_t chunk_count;
+	struct hexx_chunk* chunks;
+
+	size_t assigned;
+	size_t taken;
+	size_t emitted;
+};
+
+struct hexx_reverse
+{
+	int fd;
+	bool seekable;
+	row_decoder decoder;
+
+	bool started;
+	off_t position;
+	off_t end;
+
+	unsigned char* out;
+	size_t out_size;
+	off_t out_offset;
+
+	unsigned char prev[ROW_SIZE];
+	size_t prev_size;
+	off_t prev_offset;
+	bool repeat;
+};
+
+struct hexx_window
+{
+	off_t start;
+	off_t length;
+	bool has_start;
+};
+
+struct hexx_search
+{
+	unsigned char pattern[MAX_PATTERN_SIZE];
+	size_t pattern_size;
+	size_t context;
+	pattern_finder finder;
+
+	off_t origin;
+	off_t scan;
+
+	bool ranged;
+	bool printed;
+	off_t print_from;
+	off_t print_to;
+};
+
+struct hexx_state
+{
+	bool reverse;
+	struct hexx_search search;
+	size_t window_count;
+	struct hexx_window windows[MAX_WINDOWS];
+
+	unsigned int jobs;
+	bool holes;
+	bool squeeze;
+	size_t window_size;
+	struct hexx_pool* pool;
+
+	bool tty;
+	bool seekable;
+	int shift;
+	off_t offset;
+	off_t file_size;
+
+	unsigned char* in;
+
+	row_kernel kernel;
+	size_t line_size;
+
+	unsigned char carry[ROW_SIZE];
+	size_t carry_size;
+
+	unsigned char prev[ROW_SIZE];
+	bool prev_valid;
+	bool starred;
+
+	unsigned char* out;
+	size_t out_size;
+	size_t out_capacity;
+
+	size_t pipe_size;
+	unsigned char* spare;
+};
+
+static bool parse_arguments(struct hexx_state*, int, char**);
+static bool parse_offset(const char*, off_t*);
+static bool parse_pattern(const char*, struct hexx_search*);
+static struct hexx_window* add_window(struct hexx_state*);
+static bool prepare(struct hexx_state*);
+static bool dump_window(struct hexx_state*, int, const struct hexx_window*);
+static bool discard(struct hexx_state*, int, off_t);
+static bool dump_mapped(struct hexx_state*, int, off_t);
+static off_t skip_hole(struct hexx_state*, int, off_t);
+static bool dump_stream(struct hexx_state*, int, off_t);
+static bool feed(struct hexx_state*, const unsigned char*, size_t);
+static void emit_rows(struct hexx_state*, const unsigned char*, size_t);
+static bool feed_parallel(struct hexx_state*, const unsigned char*, size_t);
+static bool pool_start(struct hexx_state*);
+static bool pool_emit(struct hexx_pool*);
+static void* pool_worker(void*);
+static void pool_stop(struct hexx_pool*);
+static bool finish(struct hexx_state*);
+static bool emit_carry(struct hexx_state*);
+static size_t format_span(const struct hexx_state*, unsigned char*, off_t, const unsigned char*, size_t, const unsigned char*, bool*);
+static size_t format_rows(const struct hexx_state*, unsigned char*, off_t, const unsigned char*, size_t);
+static size_t format_row(const struct hexx_state*, unsigned char*, off_t, const unsigned char*, size_t);
+static size_t format_offset(const struct hexx_state*, unsigned char*, off_t);
+static size_t format_hole(const struct hexx_state*, unsigned char*, off_t, off_t);
+static size_t format_star(const struct hexx_state*, unsigned char*);
+static size_t format_end(const struct hexx_state*, unsigned char*, off_t);
+static size_t format_hex(const struct hexx_state*, unsigned char*, off_t);
+static bool row_equal(const unsigned char*, const unsigned char*);
+static row_kernel select_kernel(void);
+static void kernel_scalar(unsigned char*, size_t, const unsigned char*, size_t);
+#ifdef HEXX_X86
+static void kernel_ssse3(unsigned char*, size_t, const unsigned char*, size_t);
+static void kernel_avx2(unsigned char*, size_t, const unsigned char*, size_t);
+#endif
+static bool search_window(struct hexx_state*, int, off_t);
+static bool search_block(struct hexx_state*, const unsigned char*, off_t, size_t, bool, off_t*);
+static bool search_print(struct hexx_state*, const unsigned char*, off_t, off_t, off_t);
+static off_t search_row(const struct hexx_search*, off_t);
+static pattern_finder select_finder(void);
+#ifdef HEXX_X86
+static const unsigned char* finder_sse2(const unsigned char*, size_t, const unsigned char*, size_t);
+static const unsigned char* finder_avx2(const unsigned char*, size_t, const unsigned char*, size_t);
+#else
+static const unsigned char* finder_scalar(const unsigned char*, size_t, const unsigned char*, size_t);
+#endif
+static bool reverse(void);
+static bool reverse_line(struct hexx_reverse*, const unsigned char*, const unsigned char*);
+static bool reverse_fill(struct hexx_reverse*, off_t);
+static bool reverse_emit(struct hexx_reverse*, off_t, const unsigned char*, size_t);
+static bool reverse_flush(struct hexx_reverse*);
+static const unsigned char* skip_escapes(const unsigned char*, const unsigned char*);
+static int hex_value(unsigned char);
+static row_decoder select_decoder(void);
+static bool decoder_scalar(unsigned char*, const unsigned char*);
+#ifdef HEXX_X86
+static bool decoder_ssse3(unsigned char*, const unsigned char*);
+#endif
+static bool prepare_splice(struct hexx_state*);
+static bool flush(struct hexx_state*);
+static bool splice_all(struct hexx_state*);
+static bool write_all(int, const void*, size_t);
+static void cleanup(struct hexx_state*);
+
+static const char hex[] = "0123456789ABCDEF";
+
+static char hex_pairs[256][2];
+static unsigned char gutter[256];
 
 int main(int argc, char** argv)
 {
-	off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
-	if (offset == -1)
-		offset = 0;
+	__attribute((cleanup(cleanup)))
+	struct hexx_state state = {};
+
+	if (!parse_arguments(&state, argc, argv))
+		return 1;
+
+	if (state.reverse)
+		return reverse() ? 0 : 1;
+
+	if (!prepare(&state))
+		return 1;
+
+	if (!state.window_count)
+	{
+		struct hexx_window* window = add_window(&state);
+		window->length = -1;
+	}
+
+	for (size_t i = 0; i < state.window_count; ++i)
+	{
+		if (!dump_window(&state, STDIN_FILENO, state.windows + i))
+			return 1;
+	}
+
+	return 0;
+}
+
+static bool parse_arguments(struct hexx_state* state, int argc, char** argv)
+{
+	state->jobs = 1;
+	state->search.context = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "aC:e:Hj:n:rs:")) != -1)
+	{
+		char* endptr;
+		unsigned long int value;
+
+		switch (opt)
+		{
+			case 'a':
+				state->squeeze = true;
+				break;
+			case 'C':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || value > MAX_CONTEXT)
+				{
+					fprintf(stderr, "-C: invalid context %s\n", optarg);
+					return false;
+				}
+				state->search.context = value;
+				break;
+			case 'e':
+				if (!parse_pattern(optarg, &state->search))
+				{
+					fprintf(stderr, "-e: invalid pattern %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'H':
+				state->holes = true;
+				break;
+			case 'j':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || value < 1 || value > MAX_JOBS)
+				{
+					fprintf(stderr, "-j: invalid job count %s\n", optarg);
+					return false;
+				}
+				state->jobs = value;
+				break;
+			case 'n':
+				if (!state->window_count || state->windows[state->window_count - 1].length >= 0)
+				{
+					if (!add_window(state))
+						return false;
+				}
+				if (!parse_offset(optarg, &state->windows[state->window_count - 1].length))
+				{
+					fprintf(stderr, "-n: invalid length %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'r':
+				state->reverse = true;
+				break;
+			case 's':
+				if (!add_window(state))
+					return false;
+				if (!parse_offset(optarg, &state->windows[state->window_count - 1].start))
+				{
+					fprintf(stderr, "-s: invalid offset %s\n", optarg);
+					return false;
+				}
+				state->windows[state->window_count - 1].has_start = true;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return optind == argc;
+}
+
+static bool parse_offset(const char* s, off_t* value)
+{
+	char* endptr;
+	errno = 0;
+	unsigned long long int result = strtoull(s, &endptr, 0);
+
+	if (!*s || *endptr || errno || result > INT64_MAX)
+		return false;
+
+	*value = result;
+	return true;
+}
+
+static bool parse_pattern(const char* s, struct hexx_search* search)
+{
+	search->pattern_size = 0;
+
+	for (int hi = -1; *s; ++s)
+	{
+		if (*s == ' ' || *s == ':')
+			continue;
+
+		int nibble = hex_value(*s);
+		if (nibble < 0)
+			return false;
+
+		if (hi < 0)
+		{
+			hi = nibble;
+			continue;
+		}
+
+		if (search->pattern_size == MAX_PATTERN_SIZE)
+			return false;
+
+		search->pattern[search->pattern_size++] = (hi << 4) | nibble;
+		hi = -1;
+	}
+
+	return search->pattern_size > 0;
+}
+
+static struct hexx_window* add_window(struct hexx_state* state)
+{
+	if (state->window_count == MAX_WINDOWS)
+	{
+		fprintf(stderr, "too many windows\n");
+		return NULL;
+	}
+
+	struct hexx_window* window = state->windows + state->window_count++;
+	window->start = 0;
+	window->length = -1;
+	window->has_start = false;
+	return window;
+}
+
+static bool prepare(struct hexx_state* state)
+{
+	state->offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	state->seekable = state->offset != -1;
+	if (state->offset == -1)
+		state->offset = 0;
+
+	struct stat sb;
+	if (fstat(STDIN_FILENO, &sb) == -1)
+		memset(&sb, 0, sizeof(sb));
+
+	state->file_size = S_ISREG(sb.st_mode) ? sb.st_size : 0;
+	state->tty = isatty(STDOUT_FILENO);
+	state->shift = sb.st_size > 0xffffffff ? 60 : 28;
+
+	for (size_t i = 0; i < state->window_count; ++i)
+	{
+		const struct hexx_window* window = state->windows + i;
+		if (window->start > 0xffffffff || (window->length >= 0 && window->start + window->length > 0xffffffff))
+			state->shift = 60;
+	}
+
+	for (int c = 0; c < 256; ++c)
+	{
+		hex_pairs[c][0] = hex[c >> 4];
+		hex_pairs[c][1] = hex[c & 0x0f];
+		gutter[c] = c < 0x20 || c >= 0x7f ? '.' : c;
+	}
+
+	state->kernel = select_kernel();
+	state->search.finder = select_finder();
+
+	unsigned char prefix[LINE_MAX_SIZE];
+	state->line_size = format_offset(state, prefix, 0) + ROW_TEXT_SIZE;
+
+	state->window_size = MAP_WINDOW_SIZE;
+	if (state->jobs > 1 && state->window_size < (size_t)CHUNK_SIZE * 8 * state->jobs)
+		state->window_size = (size_t)CHUNK_SIZE * 8 * state->jobs;
+
+	state->out_capacity = (BLOCK_SIZE / ROW_SIZE + 1) * LINE_MAX_SIZE;
+	state->in = malloc(BLOCK_SIZE);
+	if (!state->in)
+		return false;
+
+	if (prepare_splice(state))
+		return true;
+
+	state->out = malloc(state->out_capacity);
+	return state->out != NULL;
+}
+
+static bool dump_window(struct hexx_state* state, int fd, const struct hexx_window* window)
+{
+	if (window->has_start)
+	{
+		if (state->seekable)
+		{
+			if (lseek(fd, window->start, SEEK_SET) == -1)
+				return false;
+		}
+		else if (!discard(state, fd, window->start))
+			return false;
+
+		state->offset = window->start;
+	}
+
+	off_t end = -1;
+	if (window->length >= 0)
+		end = state->offset + window->length;
+
+	state->prev_valid = false;
+	state->starred = false;
+
+	if (state->search.pattern_size)
+		return search_window(state, fd, end);
+
+	return dump_mapped(state, fd, end) && dump_stream(state, fd, end) && finish(state);
+}
+
+static bool discard(struct hexx_state* state, int fd, off_t position)
+{
+	if (position < state->offset)
+	{
+		fprintf(stderr, "-s: offset %jX is behind the current position of unseekable input\n", (intmax_t)position);
+		return false;
+	}
+
+	while (state->offset < position)
+	{
+		off_t remaining = position - state->offset;
+		ssize_t size;
+
+		do { size = read(fd, state->in, remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE); }
+		while (size == -1 && errno == EINTR);
+
+		if (size < 0)
+			return false;
+
+		if (!size)
+			break;
+
+		state->offset += size;
+	}
+
+	return true;
+}
+
+static bool dump_mapped(struct hexx_state* state, int fd, off_t limit)
+{
+	off_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+	if (limit < 0 || limit > state->file_size)
+		limit = state->file_size;
+
+	if (state->offset + (off_t)state->carry_size >= limit)
+		return true;
+
+	while (state->offset + (off_t)state->carry_size < limit)
+	{
+		off_t end = limit;
+		if (state->holes)
+		{
+			end = skip_hole(state, fd, end);
+			if (end == -1)
+				return false;
+
+			if (state->offset + (off_t)state->carry_size >= limit)
+				break;
+		}
+
+		off_t position = state->offset + (off_t)state->carry_size;
+		off_t base = position & ~page_mask;
+		off_t length = end - base;
+		if (length > (off_t)state->window_size)
+			length = state->window_size;
+
+		unsigned char* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, base);
+		if (map == MAP_FAILED)
+			break;
+
+		madvise(map, length, MADV_SEQUENTIAL);
+		bool result = state->jobs > 1
+			? feed_parallel(state, map + (position - base), length - (position - base))
+			: feed(state, map + (position - base), length - (position - base));
+		munmap(map, length);
+
+		if (!result)
+			return false;
+	}
+
+	return lseek(fd, state->offset + state->carry_size, SEEK_SET) != -1;
+}
+
+static off_t skip_hole(struct hexx_state* state, int fd, off_t end)
+{
+	off_t position = state->offset + state->carry_size;
+
+	off_t data = lseek(fd, position, SEEK_DATA);
+	if (data == -1)
+	{
+		if (errno != ENXIO)
+		{
+			state->holes = false;
+			return end;
+		}
+
+		data = end;
+	}
+
+	if (data > end)
+		data = end;
+
+	off_t hole_start = state->offset + (state->carry_size ? ROW_SIZE : 0);
+	off_t hole_end = state->offset + (data - state->offset) / ROW_SIZE * ROW_SIZE;
+
+	if (hole_end > hole_start)
+	{
+		static const unsigned char zero[ROW_SIZE];
+		if (state->carry_size && !feed(state, zero, ROW_SIZE - state->carry_size))
+			return -1;
+
+		if (state->out_capacity - state->out_size < LINE_MAX_SIZE && !flush(state))
+			return -1;
+
+		state->out_size += format_hole(state, state->out + state->out_size, hole_start, hole_end);
+		state->offset = hole_end;
+		state->prev_valid = false;
+		state->starred = false;
+	}
+
+	if (data >= end)
+		return end;
+
+	off_t hole = lseek(fd, data, SEEK_HOLE);
+	return hole == -1 || hole > end ? end : hole;
+}
+
+static bool dump_stream(struct hexx_state* state, int fd, off_t end)
+{
+	while (1)
+	{
+		size_t request = BLOCK_SIZE;
+		if (end >= 0)
+		{
+			off_t remaining = end - (state->offset + state->carry_size);
+			if (remaining <= 0)
+				break;
+			if (remaining < BLOCK_SIZE)
+				request = remaining;
+		}
+
+		ssize_t size;
+
+		do { size = read(fd, state->in, request); }
+		while (size == -1 && errno == EINTR);
+
+		if (!size)
+			break;
+
+		if (size < 0 || !feed(state, state->in, size))
+			return false;
+
+		// Like the row-at-a-time reader this replaced, a short read ends the row it stops in.
+		if ((size_t)size < request && state->carry_size && !emit_carry(state))
+			return false;
+
+		if (!flush(state))
+			return false;
+	}
+
+	return true;
+}
+
+static bool feed(struct hexx_state* state, const unsigned char* data, size_t size)
+{
+	if (state->carry_size)
+	{
+		size_t fill = ROW_SIZE - state->carry_size;
+		if (fill > size)
+			fill = size;
+
+		memcpy(state->carry + state->carry_size, data, fill);
+		state->carry_size += fill;
+		data += fill;
+		size -= fill;
+
+		if (state->carry_size < ROW_SIZE)
+			return true;
+
+		if (state->out_capacity - state->out_size < LINE_MAX_SIZE && !flush(state))
+			return false;
+
+		emit_rows(state, state->carry, 1);
+		state->carry_size = 0;
+	}
+
+	while (size >= ROW_SIZE)
+	{
+		size_t rows = (state->out_capacity - state->out_size) / state->line_size;
+		if (!rows)
+		{
+			if (!flush(state))
+				return false;
+			continue;
+		}
+
+		if (rows > size / ROW_SIZE)
+			rows = size / ROW_SIZE;
+
+		emit_rows(state, data, rows);
+		data += rows * ROW_SIZE;
+		size -= rows * ROW_SIZE;
+	}
+
+	memcpy(state->carry, data, size);
+	state->carry_size = size;
+	return true;
+}
+
+static void emit_rows(struct hexx_state* state, const unsigned char* data, size_t rows)
+{
+	state->out_size += format_span(state, state->out + state->out_size, state->offset, data, rows,
+		state->prev_valid ? state->prev : NULL, &state->starred);
+	state->offset += rows * ROW_SIZE;
+
+	memcpy(state->prev, data + (rows - 1) * ROW_SIZE, ROW_SIZE);
+	state->prev_valid = true;
+}
+
+static bool feed_parallel(struct hexx_state* state, const unsigned char* data, size_t size)
+{
+	if (state->carry_size)
+	{
+		size_t fill = ROW_SIZE - state->carry_size;
+		if (fill > size)
+			fill = size;
+
+		if (!feed(state, data, fill))
+			return false;
+
+		data += fill;
+		size -= fill;
+	}
+
+	if (!flush(state))
+		return false;
+
+	if (!state->pool && !pool_start(state))
+		return false;
+
+	struct hexx_pool* pool = state->pool;
+	size_t chunk_rows = CHUNK_SIZE / ROW_SIZE;
+
+	const unsigned char* start = data;
+	struct hexx_chunk* chunk = NULL;
+
+	while (size >= ROW_SIZE)
+	{
+		if (pool->assigned - pool->emitted == pool->chunk_count && !pool_emit(pool))
+			return false;
+
+		size_t rows = size / ROW_SIZE;
+		if (rows > chunk_rows)
+			rows = chunk_rows;
+
+		pthread_mutex_lock(&pool->lock);
+		chunk = pool->chunks + pool->assigned % pool->chunk_count;
+		chunk->in = data;
+		chunk->offset = state->offset;
+		chunk->rows = rows;
+
+		if (data == start)
+		{
+			chunk->prev = state->prev_valid ? state->prev : NULL;
+			chunk->starred = state->starred;
+		}
+		else
+		{
+			chunk->prev = data - ROW_SIZE;
+			chunk->starred = data - ROW_SIZE > start
+				? row_equal(data - 2 * ROW_SIZE, data - ROW_SIZE)
+				: state->prev_valid && row_equal(state->prev, data - ROW_SIZE);
+		}
+
+		++pool->assigned;
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+
+		state->offset += rows * ROW_SIZE;
+		data += rows * ROW_SIZE;
+		size -= rows * ROW_SIZE;
+	}
+
+	while (pool->emitted != pool->assigned)
+	{
+		if (!pool_emit(pool))
+			return false;
+	}
+
+	if (chunk)
+	{
+		state->starred = chunk->starred;
+		memcpy(state->prev, data - ROW_SIZE, ROW_SIZE);
+		state->prev_valid = true;
+	}
+
+	return feed(state, data, size);
+}
+
+static bool pool_start(struct hexx_state* state)
+{
+	struct hexx_pool* pool = calloc(1, sizeof(struct hexx_pool));
+	if (!pool)
+		return false;
+
+	pool->state = state;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	state->pool = pool;
+
+	pool->chunk_count = state->jobs * 2;
+	pool->chunks = calloc(pool->chunk_count, sizeof(struct hexx_chunk));
+	if (!pool->chunks)
+		return false;
+
+	for (size_t i = 0; i < pool->chunk_count; ++i)
+	{
+		pool->chunks[i].out = malloc(CHUNK_SIZE / ROW_SIZE * state->line_size);
+		if (!pool->chunks[i].out)
+			return false;
+	}
+
+	for (; pool->thread_count < state->jobs; ++pool->thread_count)
+	{
+		if (pthread_create(pool->threads + pool->thread_count, NULL, pool_worker, pool))
+			return pool->thread_count > 0;
+	}
+
+	return true;
+}
+
+static bool pool_emit(struct hexx_pool* pool)
+{
+	struct hexx_chunk* chunk = pool->chunks + pool->emitted % pool->chunk_count;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!chunk->done)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!write_all(STDOUT_FILENO, chunk->out, chunk->out_size))
+		return false;
+
+	pthread_mutex_lock(&pool->lock);
+	chunk->done = false;
+	++pool->emitted;
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+static void* pool_worker(void* context)
+{
+	struct hexx_pool* pool = context;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (pool->taken == pool->assigned && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+
+		if (pool->taken == pool->assigned)
+			break;
+
+		struct hexx_chunk* chunk = pool->chunks + pool->taken++ % pool->chunk_count;
+		pthread_mutex_unlock(&pool->lock);
+
+		chunk->out_size = format_span(pool->state, chunk->out, chunk->offset, chunk->in, chunk->rows, chunk->prev, &chunk->starred);
+
+		pthread_mutex_lock(&pool->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void pool_stop(struct hexx_pool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->thread_count; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	if (pool->chunks)
+	{
+		for (size_t i = 0; i < pool->chunk_count; ++i)
+			free(pool->chunks[i].out);
+		free(pool->chunks);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static bool finish(struct hexx_state* state)
+{
+	if (state->carry_size && !emit_carry(state))
+		return false;
+
+	if (state->starred)
+	{
+		if (state->out_capacity - state->out_size < LINE_MAX_SIZE && !flush(state))
+			return false;
+
+		state->out_size += format_end(state, state->out + state->out_size, state->offset);
+		state->starred = false;
+	}
+
+	return flush(state);
+}
+
+static bool emit_carry(struct hexx_state* state)
+{
+	if (state->out_capacity - state->out_size < LINE_MAX_SIZE && !flush(state))
+		return false;
+
+	state->out_size += format_row(state, state->out + state->out_size, state->offset, state->carry, state->carry_size);
+	state->offset += state->carry_size;
+	state->carry_size = 0;
+	state->prev_valid = false;
+	state->starred = false;
+	return true;
+}
+
+static size_t format_span(const struct hexx_state* state, unsigned char* out, off_t offset, const unsigned char* in, size_t rows, const unsigned char* prev, bool* starred)
+{
+	if (!state->squeeze)
+		return format_rows(state, out, offset, in, rows);
+
+	size_t out_size = 0;
+
+	for (size_t i = 0; i < rows;)
+	{
+		const unsigned char* row = in + i * ROW_SIZE;
+
+		if (prev && row_equal(prev, row))
+		{
+			if (!*starred)
+			{
+				out_size += format_star(state, out + out_size);
+				*starred = true;
+			}
+
+			prev = row;
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+		while (j < rows && !row_equal(in + (j - 1) * ROW_SIZE, in + j * ROW_SIZE))
+			++j;
+
+		out_size += format_rows(state, out + out_size, offset + i * ROW_SIZE, row, j - i);
+		*starred = false;
+
+		prev = in + (j - 1) * ROW_SIZE;
+		i = j;
+	}
+
+	return out_size;
+}
+
+static size_t format_rows(const struct hexx_state* state, unsigned char* out, off_t offset, const unsigned char* in, size_t rows)
+{
+	size_t prefix_size = state->line_size - ROW_TEXT_SIZE;
+
+	for (size_t i = 0; i < rows; ++i)
+		format_offset(state, out + i * state->line_size, offset + i * ROW_SIZE);
+
+	state->kernel(out + prefix_size, state->line_size, in, rows);
+	return rows * state->line_size;
+}
+
+static size_t format_row(const struct hexx_state* state, unsigned char* out, off_t offset, const unsigned char* in, size_t in_size)
+{
+	if (in_size == ROW_SIZE)
+		return format_rows(state, out, offset, in, 1);
+
+	size_t out_size = format_offset(state, out, offset);
+
+	for (size_t i = 0; i < ROW_SIZE; ++i)
+	{
+		if (i < in_size)
+		{
+			memcpy(out + out_size, hex_pairs[in[i]], 2);
+			out_size += 2;
+		}
+		else
+		{
+			out[out_size++] = ' ';
+			out[out_size++] = ' ';
+		}
+
+		out[out_size++] = ' ';
+	}
+
+	out[out_size++] = ' ';
+
+	for (size_t i = 0; i < in_size; ++i)
+		out[out_size++] = gutter[in[i]];
+
+	out[out_size++] = '\n';
+	return out_size;
+}
+
+static size_t format_offset(const struct hexx_state* state, unsigned char* out, off_t offset)
+{
+	size_t out_size = 0;
+
+	if (state->tty)
+	{
+		memcpy(out, "\x1B[2m", 4);
+		out_size += 4;
+	}
+
+	out_size += format_hex(state, out + out_size, offset);
+
+	if (state->tty)
+	{
+		memcpy(out + out_size, "\x1B[0m", 4);
+		out_size += 4;
+	}
+
+	out[out_size++] = ' ';
+	out[out_size++] = ' ';
+	return out_size;
+}
+
+static size_t format_hole(const struct hexx_state* state, unsigned char* out, off_t start, off_t end)
+{
+	size_t out_size = format_offset(state, out, start);
+
+	memcpy(out + out_size, "[hole ", 6);
+	out_size += 6;
+	out_size += format_hex(state, out + out_size, end);
+	out[out_size++] = ']';
+	out[out_size++] = '\n';
+	return out_size;
+}
+
+static size_t format_star(const struct hexx_state* state, unsigned char* out)
+{
+	if (!state->tty)
+	{
+		memcpy(out, "*\n", 2);
+		return 2;
+	}
+
+	memcpy(out, "\x1B[2m*\x1B[0m\n", 10);
+	return 10;
+}
+
+static size_t format_end(const struct hexx_state* state, unsigned char* out, off_t offset)
+{
+	size_t out_size = format_offset(state, out, offset) - 2;
+	out[out_size++] = '\n';
+	return out_size;
+}
+
+static size_t format_hex(const struct hexx_state* state, unsigned char* out, off_t value)
+{
+	size_t out_size = 0;
+
+	for (int shift = state->shift - 4; shift >= 0; shift -= 8)
+	{
+		memcpy(out + out_size, hex_pairs[(value >> shift) & 0xff], 2);
+		out_size += 2;
+	}
+
+	return out_size;
+}
+
+static bool row_equal(const unsigned char* a, const unsigned char* b)
+{
+#ifdef __SSE2__
+	__m128i va = _mm_loadu_si128((const __m128i*)a);
+	__m128i vb = _mm_loadu_si128((const __m128i*)b);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+#else
+	return !memcmp(a, b, ROW_SIZE);
+#endif
+}
+
+static row_kernel select_kernel(void)
+{
+#ifdef HEXX_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return kernel_avx2;
+
+	if (__builtin_cpu_supports("ssse3"))
+		return kernel_ssse3;
+#endif
+
+	return kernel_scalar;
+}
+
+static void kernel_scalar(unsigned char* out, size_t stride, const unsigned char* in, size_t rows)
+{
+	for (; rows; --rows, out += stride, in += ROW_SIZE)
+	{
+		unsigned char* p = out;
+
+		for (size_t i = 0; i < ROW_SIZE; ++i, p += 3)
+		{
+			memcpy(p, hex_pairs[in[i]], 2);
+			p[2] = ' ';
+		}
+
+		*p++ = ' ';
+
+		for (size_t i = 0; i < ROW_SIZE; ++i)
+			*p++ = gutter[in[i]];
+
+		*p = '\n';
+	}
+}
+
+#ifdef HEXX_X86
+/*
+ * The hex column is 16 groups of "XX ", so each of its three 16-byte
+ * vectors picks high digits, low digits and spaces from fixed lanes.
+ */
+#define SPREAD_HI(k) \
+	_mm_setr_epi8(SPREAD(k, 0, 0), SPREAD(k, 1, 0), SPREAD(k, 2, 0), SPREAD(k, 3, 0), \
+		SPREAD(k, 4, 0), SPREAD(k, 5, 0), SPREAD(k, 6, 0), SPREAD(k, 7, 0), \
+		SPREAD(k, 8, 0), SPREAD(k, 9, 0), SPREAD(k, 10, 0), SPREAD(k, 11, 0), \
+		SPREAD(k, 12, 0), SPREAD(k, 13, 0), SPREAD(k, 14, 0), SPREAD(k, 15, 0))
+#define SPREAD_LO(k) \
+	_mm_setr_epi8(SPREAD(k, 0, 1), SPREAD(k, 1, 1), SPREAD(k, 2, 1), SPREAD(k, 3, 1), \
+		SPREAD(k, 4, 1), SPREAD(k, 5, 1), SPREAD(k, 6, 1), SPREAD(k, 7, 1), \
+		SPREAD(k, 8, 1), SPREAD(k, 9, 1), SPREAD(k, 10, 1), SPREAD(k, 11, 1), \
+		SPREAD(k, 12, 1), SPREAD(k, 13, 1), SPREAD(k, 14, 1), SPREAD(k, 15, 1))
+#define SPREAD_SP(k) \
+	_mm_setr_epi8(SPACE(k, 0), SPACE(k, 1), SPACE(k, 2), SPACE(k, 3), \
+		SPACE(k, 4), SPACE(k, 5), SPACE(k, 6), SPACE(k, 7), \
+		SPACE(k, 8), SPACE(k, 9), SPACE(k, 10), SPACE(k, 11), \
+		SPACE(k, 12), SPACE(k, 13), SPACE(k, 14), SPACE(k, 15))
+#define SPREAD(k, i, d) ((((k) * 16 + (i)) % 3) == (d) ? ((k) * 16 + (i)) / 3 : -128)
+#define SPACE(k, i) ((((k) * 16 + (i)) % 3) == 2 ? ' ' : 0)
+
+__attribute__((target("ssse3")))
+static inline void store_row_ssse3(unsigned char* out, __m128i v)
+{
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+
+	__m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+	__m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+
+	_mm_storeu_si128((__m128i*)(out + 0), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(hi, SPREAD_HI(0)), _mm_shuffle_epi8(lo, SPREAD_LO(0))), SPREAD_SP(0)));
+	_mm_storeu_si128((__m128i*)(out + 16), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(hi, SPREAD_HI(1)), _mm_shuffle_epi8(lo, SPREAD_LO(1))), SPREAD_SP(1)));
+	_mm_storeu_si128((__m128i*)(out + 32), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(hi, SPREAD_HI(2)), _mm_shuffle_epi8(lo, SPREAD_LO(2))), SPREAD_SP(2)));
+
+	__m128i printable = _mm_and_si128(
+		_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+
+	out[48] = ' ';
+	_mm_storeu_si128((__m128i*)(out + 49), _mm_or_si128(
+		_mm_and_si128(printable, v),
+		_mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+	out[65] = '\n';
+}
+
+__attribute__((target("ssse3")))
+static void kernel_ssse3(unsigned char* out, size_t stride, const unsigned char* in, size_t rows)
+{
+	for (; rows; --rows, out += stride, in += ROW_SIZE)
+		store_row_ssse3(out, _mm_loadu_si128((const __m128i*)in));
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(unsigned char* out, size_t stride, const unsigned char* in, size_t rows)
+{
+	const __m256i digits = _mm256_setr_epi8(
+		'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+		'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i spread_hi[3] = {
+		_mm256_broadcastsi128_si256(SPREAD_HI(0)),
+		_mm256_broadcastsi128_si256(SPREAD_HI(1)),
+		_mm256_broadcastsi128_si256(SPREAD_HI(2)) };
+	const __m256i spread_lo[3] = {
+		_mm256_broadcastsi128_si256(SPREAD_LO(0)),
+		_mm256_broadcastsi128_si256(SPREAD_LO(1)),
+		_mm256_broadcastsi128_si256(SPREAD_LO(2)) };
+	const __m256i spread_sp[3] = {
+		_mm256_broadcastsi128_si256(SPREAD_SP(0)),
+		_mm256_broadcastsi128_si256(SPREAD_SP(1)),
+		_mm256_broadcastsi128_si256(SPREAD_SP(2)) };
+
+	for (; rows >= 2; rows -= 2, out += 2 * stride, in += 2 * ROW_SIZE)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)in);
+		__m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		__m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, nibble));
+
+		for (int k = 0; k < 3; ++k)
+		{
+			__m256i text = _mm256_or_si256(_mm256_or_si256(
+				_mm256_shuffle_epi8(hi, spread_hi[k]), _mm256_shuffle_epi8(lo, spread_lo[k])), spread_sp[k]);
+			_mm_storeu_si128((__m128i*)(out + k * 16), _mm256_castsi256_si128(text));
+			_mm_storeu_si128((__m128i*)(out + stride + k * 16), _mm256_extracti128_si256(text, 1));
+		}
+
+		__m256i printable = _mm256_and_si256(
+			_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1f)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+		__m256i text = _mm256_blendv_epi8(_mm256_set1_epi8('.'), v, printable);
+
+		out[48] = ' ';
+		_mm_storeu_si128((__m128i*)(out + 49), _mm256_castsi256_si128(text));
+		out[65] = '\n';
+
+		out[stride + 48] = ' ';
+		_mm_storeu_si128((__m128i*)(out + stride + 49), _mm256_extracti128_si256(text, 1));
+		out[stride + 65] = '\n';
+	}
+
+	if (rows)
+		store_row_ssse3(out, _mm_loadu_si128((const __m128i*)in));
+}
+#endif
+
+static bool search_window(struct hexx_state* state, int fd, off_t end)
+{
+	struct hexx_search* search = &state->search;
 
-	struct stat sb;
-	if (fstat(STDIN_FILENO, &sb) == -1)
-		memset(&sb, 0, sizeof(sb));
+	size_t capacity = SEARCH_BLOCK_SIZE + (search->context * 2 + 2) * ROW_SIZE + search->pattern_size;
+	unsigned char* buffer = malloc(capacity);
+	if (!buffer)
+		return false;
 
-	int tty = isatty(STDOUT_FILENO);
-	while (1)
+	search->origin = state->offset;
+	search->scan = state->offset;
+	search->ranged = false;
+
+	off_t base = state->offset;
+	size_t size = 0;
+	bool result = true;
+
+	while (result)
 	{
-		unsigned char in_buffer[16];
-		ssize_t in_size;
+		size_t request = capacity - size;
+		if (end >= 0 && (off_t)request > end - (base + (off_t)size))
+			request = end - (base + size);
 
-		do { in_size = read(STDIN_FILENO, in_buffer, sizeof(in_buffer)); }
-		while (in_size == -1 && errno == EINTR);
+		ssize_t count = 0;
+		if (request)
+		{
+			do { count = read(fd, buffer + size, request); }
+			while (count == -1 && errno == EINTR);
 
-		if (!in_size)
-			return 0;
+			if (count < 0)
+			{
+				result = false;
+				break;
+			}
+		}
 
-		if (in_size < 0)
-			return 1;
+		size += count;
 
-		unsigned char out_buffer[4+16+4+2+(16*(2+1))+1+16+1];
-		size_t out_size = 0;
+		off_t keep = base;
+		result = search_block(state, buffer, base, size, !count, &keep);
+		if (!result || !count)
+			break;
 
-		if (tty)
-		{
-			out_buffer[out_size++] = '\x1B';
-			out_buffer[out_size++] = '[';
-			out_buffer[out_size++] = '2';
-			out_buffer[out_size++] = 'm';
-		}
+		memmove(buffer, buffer + (keep - base), size - (keep - base));
+		size -= keep - base;
+		base = keep;
+	}
 
-		static const char hex[] = "0123456789ABCDEF";
+	state->offset = base + size;
+	free(buffer);
+	return result && flush(state);
+}
 
-		for (int shift = (sb.st_size > 0xffffffff ? 60 : 28); shift >= 0; shift -= 4)
-			out_buffer[out_size++] = hex[(offset >> shift) & 0xf];
+static bool search_block(struct hexx_state* state, const unsigned char* data, off_t base, size_t size, bool eof, off_t* keep)
+{
+	struct hexx_search* search = &state->search;
+	off_t end = base + size;
+	off_t margin = search->context * ROW_SIZE;
 
-		if (tty)
+	for (off_t limit = end - search->pattern_size + 1; search->scan < limit;)
+	{
+		const unsigned char* found = search->finder(data + (search->scan - base), end - search->scan, search->pattern, search->pattern_size);
+		if (!found)
 		{
-			out_buffer[out_size++] = '\x1B';
-			out_buffer[out_size++] = '[';
-			out_buffer[out_size++] = '0';
-			out_buffer[out_size++] = 'm';
+			search->scan = limit;
+			break;
 		}
 
-		out_buffer[out_size++] = ' ';
-		out_buffer[out_size++] = ' ';
+		off_t match = base + (found - data);
+		off_t first = search_row(search, match) - margin;
+		off_t last = search_row(search, match + search->pattern_size - 1) + ROW_SIZE + margin;
 
-		for (int i = 0; i < 16; ++i)
+		if (first < search->origin)
+			first = search->origin;
+
+		if (search->ranged && first <= search->print_to)
 		{
-			if (i < in_size)
-			{
-				unsigned char c = in_buffer[i];
-				out_buffer[out_size++] = hex[(c >> 4) & 0x0f];
-				out_buffer[out_size++] = hex[c & 0x0f];
-			}
-			else
+			if (search->print_to < last)
+				search->print_to = last;
+		}
+		else
+		{
+			if (search->ranged && !search_print(state, data, base, end, search->print_to))
+				return false;
+
+			if (search->printed)
 			{
-				out_buffer[out_size++] = ' ';
-				out_buffer[out_size++] = ' ';
+				if (state->out_capacity - state->out_size < LINE_MAX_SIZE && !flush(state))
+					return false;
+
+				memcpy(state->out + state->out_size, "--\n", 3);
+				state->out_size += 3;
 			}
 
-			out_buffer[out_size++] = ' ';
+			search->ranged = true;
+			search->printed = true;
+			search->print_from = first;
+			search->print_to = last;
+		}
+
+		search->scan = match + 1;
+	}
+
+	if (search->ranged)
+	{
+		off_t available = eof ? end : search_row(search, end);
+		if (!search_print(state, data, base, end, search->print_to < available ? search->print_to : available))
+			return false;
+	}
+
+	*keep = search_row(search, search->scan) - margin;
+	if (search->ranged && search->print_from < search->print_to && search->print_from < *keep)
+		*keep = search->print_from;
+	if (*keep < base)
+		*keep = base;
+
+	return true;
+}
+
+static bool search_print(struct hexx_state* state, const unsigned char* data, off_t base, off_t end, off_t to)
+{
+	struct hexx_search* search = &state->search;
+
+	if (to > end)
+		to = end;
+
+	while (search->print_from < to)
+	{
+		size_t rows = (to - search->print_from) / ROW_SIZE;
+		size_t capacity = (state->out_capacity - state->out_size) / state->line_size;
+		if (!capacity)
+		{
+			if (!flush(state))
+				return false;
+			continue;
+		}
+
+		const unsigned char* row = data + (search->print_from - base);
+
+		if (!rows)
+		{
+			state->out_size += format_row(state, state->out + state->out_size, search->print_from, row, to - search->print_from);
+			search->print_from = to;
+			break;
+		}
+
+		if (rows > capacity)
+			rows = capacity;
+
+		state->out_size += format_rows(state, state->out + state->out_size, search->print_from, row, rows);
+		search->print_from += rows * ROW_SIZE;
+	}
+
+	return true;
+}
+
+static off_t search_row(const struct hexx_search* search, off_t offset)
+{
+	return search->origin + (offset - search->origin) / ROW_SIZE * ROW_SIZE;
+}
+
+static pattern_finder select_finder(void)
+{
+#ifdef HEXX_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return finder_avx2;
+
+	return finder_sse2;
+#else
+	return finder_scalar;
+#endif
+}
+
+#ifndef HEXX_X86
+static const unsigned char* finder_scalar(const unsigned char* data, size_t size, const unsigned char* pattern, size_t pattern_size)
+{
+	const unsigned char* end = data + size - pattern_size + 1;
+
+	for (const unsigned char* p = data; p < end; ++p)
+	{
+		p = memchr(p, pattern[0], end - p);
+		if (!p)
+			break;
+
+		if (!memcmp(p, pattern, pattern_size))
+			return p;
+	}
+
+	return NULL;
+}
+#endif
+
+#ifdef HEXX_X86
+/*
+ * Candidates are positions where both the first and the last byte of
+ * the pattern match; only those are compared in full.
+ */
+static const unsigned char* finder_sse2(const unsigned char* data, size_t size, const unsigned char* pattern, size_t pattern_size)
+{
+	if (size < pattern_size)
+		return NULL;
+
+	size_t count = size - pattern_size + 1;
+	const __m128i first = _mm_set1_epi8(pattern[0]);
+	const __m128i last = _mm_set1_epi8(pattern[pattern_size - 1]);
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(data + i + pattern_size - 1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		for (; mask; mask &= mask - 1)
+		{
+			const unsigned char* p = data + i + __builtin_ctz(mask);
+			if (!memcmp(p + 1, pattern + 1, pattern_size - 1))
+				return p;
+		}
+	}
+
+	for (; i < count; ++i)
+	{
+		if (data[i] == pattern[0] && !memcmp(data + i + 1, pattern + 1, pattern_size - 1))
+			return data + i;
+	}
+
+	return NULL;
+}
+
+__attribute__((target("avx2")))
+static const unsigned char* finder_avx2(const unsigned char* data, size_t size, const unsigned char* pattern, size_t pattern_size)
+{
+	if (size < pattern_size)
+		return NULL;
+
+	size_t count = size - pattern_size + 1;
+	const __m256i first = _mm256_set1_epi8(pattern[0]);
+	const __m256i last = _mm256_set1_epi8(pattern[pattern_size - 1]);
+
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(data + i + pattern_size - 1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+		for (; mask; mask &= mask - 1)
+		{
+			const unsigned char* p = data + i + __builtin_ctz(mask);
+			if (!memcmp(p + 1, pattern + 1, pattern_size - 1))
+				return p;
+		}
+	}
+
+	return finder_sse2(data + i, size - i, pattern, pattern_size);
+}
+#endif
+
+static bool reverse(void)
+{
+	struct hexx_reverse r = { .fd = STDOUT_FILENO };
+
+	struct stat sb;
+	r.seekable = fstat(r.fd, &sb) != -1 && (S_ISREG(sb.st_mode) || S_ISBLK(sb.st_mode));
+
+	r.decoder = select_decoder();
+
+	unsigned char* buffer = malloc(REVERSE_BLOCK_SIZE);
+	r.out = malloc(REVERSE_BLOCK_SIZE);
+
+	bool result = buffer && r.out;
+	size_t size = 0;
+
+	while (result)
+	{
+		ssize_t count;
+
+		do { count = read(STDIN_FILENO, buffer + size, REVERSE_BLOCK_SIZE - size); }
+		while (count == -1 && errno == EINTR);
+
+		if (count < 0)
+		{
+			result = false;
+			break;
+		}
+
+		size += count;
+
+		unsigned char* line = buffer;
+		unsigned char* end = buffer + size;
+		unsigned char* eol;
+
+		while (result && (eol = memchr(line, '\n', end - line)))
+		{
+			result = reverse_line(&r, line, eol);
+			line = eol + 1;
+		}
+
+		if (!count)
+		{
+			if (result && line != end)
+				result = reverse_line(&r, line, end);
+			break;
+		}
+
+		size = end - line;
+		if (size == REVERSE_BLOCK_SIZE)
+		{
+			fprintf(stderr, "-r: line too long\n");
+			result = false;
 		}
 
-		out_buffer[out_size++] = ' ';
+		memmove(buffer, line, size);
+	}
+
+	if (result)
+		result = reverse_fill(&r, r.end) && reverse_flush(&r);
+
+	if (result && r.seekable && S_ISREG(sb.st_mode) && fstat(r.fd, &sb) != -1 && sb.st_size < r.end)
+		result = ftruncate(r.fd, r.end) != -1;
+
+	free(r.out);
+	free(buffer);
+	return result;
+}
+
+static bool reverse_line(struct hexx_reverse* r, const unsigned char* p, const unsigned char* e)
+{
+	p = skip_escapes(p, e);
+
+	if (p < e && *p == '*')
+	{
+		r->repeat = r->prev_size == ROW_SIZE;
+		return true;
+	}
+
+	off_t offset = 0;
+	const unsigned char* digits = p;
+	for (; p < e && p - digits < 16; ++p)
+	{
+		int nibble = hex_value(*p);
+		if (nibble < 0)
+			break;
+		offset = (offset << 4) | nibble;
+	}
+
+	if (p == digits)
+		return true;
 
-		for (int i = 0; i < in_size; ++i)
+	p = skip_escapes(p, e);
+
+	if (!reverse_fill(r, offset))
+		return false;
+
+	if (p == e || *p == '\r')
+	{
+		if (r->end < offset)
+			r->end = offset;
+		r->prev_size = 0;
+		return true;
+	}
+
+	if (e - p < 2 || p[0] != ' ' || p[1] != ' ')
+		return true;
+
+	p += 2;
+
+	if (e - p > 6 && !memcmp(p, "[hole ", 6))
+	{
+		off_t hole_end = 0;
+		for (p += 6; p < e && hex_value(*p) >= 0; ++p)
+			hole_end = (hole_end << 4) | hex_value(*p);
+
+		if (r->end < hole_end)
+			r->end = hole_end;
+		r->prev_size = 0;
+		return true;
+	}
+
+	unsigned char row[ROW_SIZE];
+	size_t size = 0;
+
+	if (e - p >= ROW_SIZE * 3 && r->decoder(row, p))
+		size = ROW_SIZE;
+	else
+	{
+		for (; size < ROW_SIZE && e - p >= 2; ++size, p += 3)
 		{
-			unsigned char c = in_buffer[i];
-			out_buffer[out_size++] = c < 0x20 || c >= 0x7f ? '.' : c;
+			int hi = hex_value(p[0]);
+			int lo = hex_value(p[1]);
+			if (hi < 0 || lo < 0)
+				break;
+			row[size] = (hi << 4) | lo;
 		}
+	}
+
+	if (!size)
+		return true;
+
+	memcpy(r->prev, row, size);
+	r->prev_size = size;
+	r->prev_offset = offset;
+
+	if (r->end < offset + (off_t)size)
+		r->end = offset + size;
+
+	return reverse_emit(r, offset, row, size);
+}
+
+static bool reverse_fill(struct hexx_reverse* r, off_t offset)
+{
+	if (!r->repeat)
+		return true;
+
+	r->repeat = false;
+
+	for (off_t cursor = r->prev_offset + ROW_SIZE; cursor + ROW_SIZE <= offset; cursor += ROW_SIZE)
+	{
+		if (!reverse_emit(r, cursor, r->prev, ROW_SIZE))
+			return false;
+	}
+
+	return true;
+}
+
+static bool reverse_emit(struct hexx_reverse* r, off_t offset, const unsigned char* data, size_t size)
+{
+	if (r->out_size && (offset != r->out_offset + (off_t)r->out_size || r->out_size + size > REVERSE_BLOCK_SIZE))
+	{
+		if (!reverse_flush(r))
+			return false;
+	}
+
+	if (!r->out_size)
+		r->out_offset = offset;
 
-		out_buffer[out_size++] = '\n';
+	memcpy(r->out + r->out_size, data, size);
+	r->out_size += size;
+	return true;
+}
+
+static bool reverse_flush(struct hexx_reverse* r)
+{
+	if (!r->out_size)
+		return true;
 
-		for (off_t cursor = 0; cursor < out_size;)
+	if (r->seekable)
+	{
+		for (size_t cursor = 0; cursor < r->out_size;)
 		{
 			ssize_t result;
-			do { result = write(STDOUT_FILENO, out_buffer + cursor, out_size - cursor); }
-			while (out_size == -1 && errno == EINTR);
+			do { result = pwrite(r->fd, r->out + cursor, r->out_size - cursor, r->out_offset + cursor); }
+			while (result == -1 && errno == EINTR);
 
 			if (result < 0)
-				return 1;
+				return false;
 
 			cursor += result;
 		}
+	}
+	else
+	{
+		if (!r->started)
+		{
+			r->position = r->out_offset;
+			r->started = true;
+		}
+
+		if (r->out_offset < r->position)
+		{
+			fprintf(stderr, "-r: offset %jX goes backwards on unseekable output\n", (intmax_t)r->out_offset);
+			return false;
+		}
+
+		static const unsigned char zero[BLOCK_SIZE];
+		for (; r->position < r->out_offset; r->position += BLOCK_SIZE)
+		{
+			off_t gap = r->out_offset - r->position;
+			if (!write_all(r->fd, zero, gap < BLOCK_SIZE ? gap : BLOCK_SIZE))
+				return false;
+
+			if (gap < BLOCK_SIZE)
+			{
+				r->position = r->out_offset;
+				break;
+			}
+		}
+
+		if (!write_all(r->fd, r->out, r->out_size))
+			return false;
+
+		r->position += r->out_size;
+	}
+
+	r->out_size = 0;
+	return true;
+}
+
+static const unsigned char* skip_escapes(const unsigned char* p, const unsigned char* e)
+{
+	while (e - p >= 2 && p[0] == '\x1B' && p[1] == '[')
+	{
+		for (p += 2; p < e && *p != 'm'; ++p);
+		if (p < e)
+			++p;
+	}
+
+	return p;
+}
+
+static int hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+static row_decoder select_decoder(void)
+{
+#ifdef HEXX_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("ssse3"))
+		return decoder_ssse3;
+#endif
+
+	return decoder_scalar;
+}
+
+static bool decoder_scalar(unsigned char* out, const unsigned char* in)
+{
+	for (size_t i = 0; i < ROW_SIZE; ++i, in += 3)
+	{
+		int hi = hex_value(in[0]);
+		int lo = hex_value(in[1]);
+		if (hi < 0 || lo < 0 || in[2] != ' ')
+			return false;
+		out[i] = (hi << 4) | lo;
+	}
+
+	return true;
+}
+
+#ifdef HEXX_X86
+#define GATHER(k, d) \
+	_mm_setr_epi8(PICK(k, 0, d), PICK(k, 1, d), PICK(k, 2, d), PICK(k, 3, d), \
+		PICK(k, 4, d), PICK(k, 5, d), PICK(k, 6, d), PICK(k, 7, d), \
+		PICK(k, 8, d), PICK(k, 9, d), PICK(k, 10, d), PICK(k, 11, d), \
+		PICK(k, 12, d), PICK(k, 13, d), PICK(k, 14, d), PICK(k, 15, d))
+#define PICK(k, i, d) ((3 * (i) + (d)) / 16 == (k) ? (3 * (i) + (d)) % 16 : -128)
+
+__attribute__((target("ssse3")))
+static inline __m128i gather_ssse3(__m128i v0, __m128i v1, __m128i v2, __m128i i0, __m128i i1, __m128i i2)
+{
+	return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, i0), _mm_shuffle_epi8(v1, i1)), _mm_shuffle_epi8(v2, i2));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i nibbles_ssse3(__m128i c, __m128i* valid)
+{
+	__m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+	*valid = _mm_and_si128(*valid, _mm_or_si128(is_digit, is_letter));
+	return _mm_or_si128(
+		_mm_and_si128(is_digit, digit),
+		_mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("ssse3")))
+static bool decoder_ssse3(unsigned char* out, const unsigned char* in)
+{
+	__m128i v0 = _mm_loadu_si128((const __m128i*)(in + 0));
+	__m128i v1 = _mm_loadu_si128((const __m128i*)(in + 16));
+	__m128i v2 = _mm_loadu_si128((const __m128i*)(in + 32));
+
+	__m128i hi = gather_ssse3(v0, v1, v2, GATHER(0, 0), GATHER(1, 0), GATHER(2, 0));
+	__m128i lo = gather_ssse3(v0, v1, v2, GATHER(0, 1), GATHER(1, 1), GATHER(2, 1));
+	__m128i sp = gather_ssse3(v0, v1, v2, GATHER(0, 2), GATHER(1, 2), GATHER(2, 2));
+
+	__m128i valid = _mm_cmpeq_epi8(sp, _mm_set1_epi8(' '));
+	hi = nibbles_ssse3(hi, &valid);
+	lo = nibbles_ssse3(lo, &valid);
+
+	if (_mm_movemask_epi8(valid) != 0xffff)
+		return false;
+
+	_mm_storeu_si128((__m128i*)out, _mm_or_si128(_mm_slli_epi16(hi, 4), lo));
+	return true;
+}
+#endif
+
+/*
+ * When stdout is a pipe, full buffers are handed over with vmsplice()
+ * instead of being copied by write(). The pipe keeps referencing those
+ * pages until the reader consumes them, so two buffers alternate and
+ * only flushes of at least a pipe's worth of data are spliced: once
+ * such a flush has been accepted, the pipe can no longer hold any page
+ * of the previous buffer. Smaller flushes are copied with write() and
+ * keep filling the same buffer.
+ */
+static bool prepare_splice(struct hexx_state* state)
+{
+	struct stat sb;
+	if (fstat(STDOUT_FILENO, &sb) == -1 || !S_ISFIFO(sb.st_mode))
+		return false;
+
+	int pipe_size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		return false;
+
+	size_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	size_t capacity = (state->out_capacity + pipe_size + page_mask) & ~page_mask;
+
+	unsigned char* buffers = mmap(NULL, capacity * 2, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (buffers == MAP_FAILED)
+		return false;
+
+	state->pipe_size = pipe_size;
+	state->out_capacity = capacity;
+	state->out = buffers;
+	state->spare = buffers + capacity;
+	return true;
+}
+
+static bool flush(struct hexx_state* state)
+{
+	if (state->pipe_size && state->out_size >= state->pipe_size)
+	{
+		if (!splice_all(state))
+			return false;
+	}
+	else if (!write_all(STDOUT_FILENO, state->out, state->out_size))
+		return false;
+
+	state->out_size = 0;
+	return true;
+}
+
+static bool splice_all(struct hexx_state* state)
+{
+	struct iovec iov = { state->out, state->out_size };
+
+	while (iov.iov_len)
+	{
+		ssize_t result;
+		do { result = vmsplice(STDOUT_FILENO, &iov, 1, 0); }
+		while (result == -1 && errno == EINTR);
+
+		if (result < 0)
+		{
+			if (errno != EINVAL && errno != ENOSYS)
+				return false;
+
+			state->pipe_size = 0;
+			return write_all(STDOUT_FILENO, iov.iov_base, iov.iov_len);
+		}
+
+		iov.iov_base = (unsigned char*)iov.iov_base + result;
+		iov.iov_len -= result;
+	}
+
+	unsigned char* spliced = state->out;
+	state->out = state->spare;
+	state->spare = spliced;
+	return true;
+}
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+	for (size_t cursor = 0; cursor < size;)
+	{
+		ssize_t result;
+		do { result = write(fd, (const char*)data + cursor, size - cursor); }
+		while (result == -1 && errno == EINTR);
+
+		if (result < 0)
+			return false;
 
-		offset += in_size;
+		cursor += result;
 	}
+
+	return true;
+}
+
+static void cleanup(struct hexx_state* state)
+{
+	if (state->pool)
+		pool_stop(state->pool);
+
+	free(state->in);
+
+	if (state->spare)
+		munmap(state->out < state->spare ? state->out : state->spare, state->out_capacity * 2);
+	else
+		free(state->out);
 }
@@ -1,11 +1,16 @@
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 
 struct cidr_address
 {
@@ -13,13 +18,57 @@ struct cidr_address
 	uint32_t count;
 };
 
+struct ip_range
+{
+	uint32_t first;
+	uint32_t last;
+};
+
+enum dedup_mode
+{
+	DEDUP_AUTO,
+	DEDUP_BITMAP,
+	DEDUP_INTERVAL,
+};
+
 struct iphm_state;
 
-struct bucket_handler
+struct iphm_worker;
+struct iphm_render;
+struct iphm_file;
+
+struct iphm_engine
 {
 	size_t value_size;
-	uintptr_t (*get_value)(struct iphm_state*, uintptr_t);
-	void (*add_value)(struct iphm_state*, uintptr_t, uintptr_t);
+	void (*ingest)(struct iphm_worker*);
+	void (*merge)(struct iphm_state*);
+	void (*render)(struct iphm_render*);
+	void (*load)(struct iphm_state*, const struct iphm_file*);
+	void (*widen)(const struct iphm_state*, uint32_t*, uintptr_t, size_t);
+};
+
+struct iphm_file_header
+{
+	char magic[8];
+	uint32_t bits;
+	uint32_t reserved;
+	uint64_t extent_count;
+	uint64_t data_size;
+};
+
+// A run of non-zero bitmap words; runs of full words have the top bit of the count set and carry no payload.
+struct iphm_extent
+{
+	uint32_t first;
+	uint32_t count;
+};
+
+struct iphm_file
+{
+	const char* path;
+	int fd;
+	void* map;
+	size_t size;
 };
 
 struct rgbx
@@ -30,12 +79,57 @@ struct rgbx
 	uint8_t x;
 };
 
+struct iphm_chunk
+{
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+	bool busy;
+};
+
+struct iphm_worker
+{
+	struct iphm_state* state;
+	pthread_t thread;
+	bool started;
+
+	void* bucket;
+	uint64_t* seen;
+
+	struct ip_range* ranges;
+	size_t range_count;
+	size_t range_capacity;
+
+	struct iphm_chunk* chunk;
+	uint8_t* input;
+	size_t input_offset;
+	size_t input_size;
+	bool input_eof;
+};
+
+struct iphm_render
+{
+	struct iphm_state* state;
+	pthread_t thread;
+	bool started;
+	uint8_t* out;
+	uint32_t first_row;
+	uint32_t row_count;
+};
+
 struct iphm_state
 {
 	uint32_t bits;
 	uint32_t count;
+	uint32_t jobs;
+	uint32_t record_size;
+	bool bits_given;
+
+	struct iphm_file* files;
+	size_t file_count;
+	const char* save_path;
 
-	const struct bucket_handler* handler;
+	const struct iphm_engine* engine;
 	size_t bucket_size;
 	union
 	{
@@ -45,31 +139,119 @@ struct iphm_state
 		uint32_t* bucket_u32;
 	};
 
-	uintptr_t* seen;
+	enum dedup_mode mode;
+	uint64_t* seen;
+
+	struct iphm_worker* workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	struct iphm_chunk* chunks;
+	size_t chunk_count;
+	size_t produced;
+	size_t taken;
+	bool input_done;
 
 	struct rgbx palette[256];
+	uint16_t morton[256];
+	uint8_t* shade;
+
+	const char* tile_path;
+	uint32_t tile_level;
+	bool tile_window_given;
+	uint32_t tile_window[4];
+	uint32_t* tile_sums[33];
+	uint8_t* tile_out;
+
+	double frame_seconds;
+	uint64_t frame_every;
+	uint64_t frame_added;
+	const char* frame_path;
+	struct timespec frame_deadline;
+	uint8_t* frame;
+	size_t frame_size;
+	uint64_t* dirty_bits;
+	uintptr_t* dirty_list;
+	size_t dirty_count;
+	size_t dirty_capacity;
+	bool dirty_all;
+	bool frame_failed;
 };
 
 #define SEEN_BYTESIZE 0x20000000
+#define RANGE_LIMIT 0x400000
+#define INPUT_BLOCK_SIZE 0x100000
+#define ADDRESS_MAX_LENGTH 20
+#define MAX_JOBS 256
+#define RENDER_BATCH_SIZE 0x800000
+#define FILE_MAGIC "IPHMST02"
+#define FILE_HEADER_SIZE 0x20
+#define EXTENT_FULL 0x80000000u
+#define TILE_BITS 8
+#define TILE_PIXELS (1u << (TILE_BITS * 2u))
 
 static bool parse_arguments(struct iphm_state*, int, char**);
+static bool open_files(struct iphm_state*);
 static bool prepare(struct iphm_state*);
-static bool read_address(struct iphm_state*, struct cidr_address*);
-static void add_address(struct iphm_state*, const struct cidr_address*);
-static void add_address_single(struct iphm_state*, uint32_t);
-static uintptr_t bucket_u8_get(struct iphm_state*, uintptr_t);
-static void bucket_u8_add(struct iphm_state*, uintptr_t, uintptr_t);
-static uintptr_t bucket_u16_get(struct iphm_state*, uintptr_t);
-static void bucket_u16_add(struct iphm_state*, uintptr_t, uintptr_t);
-static uintptr_t bucket_u32_get(struct iphm_state*, uintptr_t);
-static void bucket_u32_add(struct iphm_state*, uintptr_t, uintptr_t);
+static void load_files(struct iphm_state*);
+static inline void load_file(struct iphm_state*, const struct iphm_file*, size_t);
+static bool save_file(struct iphm_state*);
+static void set_bits(uint64_t*, uint32_t, uint64_t);
+static bool check_extents(const struct iphm_file*);
+static bool ingest(struct iphm_state*);
+static void* ingest_thread(void*);
+static inline void ingest_worker(struct iphm_worker*, size_t);
+static bool split_input(struct iphm_state*);
+static inline void merge_workers(struct iphm_state*, size_t);
+static bool read_address(struct iphm_worker*, struct cidr_address*);
+static bool read_address_fast(struct iphm_worker*, struct cidr_address*);
+static bool read_record(struct iphm_worker*, struct cidr_address*);
+static int input_getc(struct iphm_worker*);
+static bool input_fill(struct iphm_worker*);
+static inline void add_address(struct iphm_worker*, const struct cidr_address*, size_t);
+static bool map_seen(struct iphm_state*);
+static inline bool spill_intervals(struct iphm_worker*, size_t);
+static inline void add_range(struct iphm_worker*, uint32_t, uint64_t, size_t);
+static inline void credit_word(struct iphm_worker*, uint32_t, uint32_t, uint64_t, size_t);
+static inline void mark_dirty(struct iphm_state*, uintptr_t);
+static bool add_interval(struct iphm_worker*, uint32_t, uint64_t);
+static int compare_ranges(const void*, const void*);
+static void coalesce_intervals(struct iphm_worker*);
+static inline void count_intervals(struct iphm_worker*, size_t);
+static inline uintptr_t bucket_get(const void*, uintptr_t, size_t);
+static inline void bucket_add(void*, uintptr_t, uintptr_t, size_t);
 static void generate_palette(struct iphm_state*);
+static void generate_tables(struct iphm_state*);
 static void render_image(struct iphm_state*);
+static bool prepare_frames(struct iphm_state*);
+static bool wait_for_input(struct iphm_state*);
+static bool emit_frame(struct iphm_state*);
+static bool write_frame(struct iphm_state*, FILE*);
+static inline uint32_t shade(const struct iphm_state*, uint64_t);
+static void* render_thread(void*);
+static inline void render_rows(struct iphm_render*, size_t);
+static inline void widen_buckets(const struct iphm_state*, uint32_t*, uintptr_t, size_t, size_t);
+static void count_tile(const struct iphm_state*, uint32_t*, uintptr_t, size_t);
+static bool render_tiles(struct iphm_state*);
+static bool sum_tile(struct iphm_state*, uint32_t, uintptr_t, uint32_t*);
+static bool write_tile(struct iphm_state*, uint32_t, uintptr_t, const uint32_t*);
+static uint32_t compact_bits(uint32_t);
 static void cleanup(struct iphm_state*);
 
-static const struct bucket_handler bucket_handler_u8 = { sizeof(uint8_t), bucket_u8_get, bucket_u8_add };
-static const struct bucket_handler bucket_handler_u16 = { sizeof(uint16_t), bucket_u16_get, bucket_u16_add };
-static const struct bucket_handler bucket_handler_u32 = { sizeof(uint32_t), bucket_u32_get, bucket_u32_add };
+// Stamps out the hot paths for one bucket width, or none at all; the generic bodies are always inlined with the width as a constant.
+#define DEFINE_ENGINE(name, size) \
+	static void ingest_worker_##name(struct iphm_worker* worker) { ingest_worker(worker, size); } \
+	static void merge_workers_##name(struct iphm_state* state) { merge_workers(state, size); } \
+	static void render_rows_##name(struct iphm_render* render) { render_rows(render, size); } \
+	static void load_file_##name(struct iphm_state* state, const struct iphm_file* file) { load_file(state, file, size); } \
+	static void widen_buckets_##name(const struct iphm_state* state, uint32_t* out, uintptr_t first, size_t count) { widen_buckets(state, out, first, count, size); } \
+	static const struct iphm_engine engine_##name = { size, ingest_worker_##name, merge_workers_##name, render_rows_##name, load_file_##name, widen_buckets_##name };
+
+DEFINE_ENGINE(uint8_t, sizeof(uint8_t))
+DEFINE_ENGINE(uint16_t, sizeof(uint16_t))
+DEFINE_ENGINE(uint32_t, sizeof(uint32_t))
+DEFINE_ENGINE(none, 0u)
 
 int main(int argc, char** argv)
 {
@@ -79,14 +261,47 @@ int main(int argc, char** argv)
 	if (!parse_arguments(&state, argc, argv))
 		return 1;
 
+	if (!open_files(&state))
+		return 2;
+
+	if (state.bits > 24)
+		state.engine = &engine_uint8_t;
+	else if (state.bits > 16)
+		state.engine = &engine_uint16_t;
+	else
+		state.engine = &engine_uint32_t;
+
+	// Tiles are counted straight from the deduplicated addresses, so no bucket array is kept unless a state file or frames need one.
+	if (state.tile_path && !state.save_path && !state.frame_every && !(state.frame_seconds > 0.0))
+		state.engine = &engine_none;
+
 	if (!prepare(&state))
 		return 2;
 
-	struct cidr_address address;
-	while (read_address(&state, &address))
-		add_address(&state, &address);
+	load_files(&state);
 
 	generate_palette(&state);
+	generate_tables(&state);
+
+	if (state.frame && !prepare_frames(&state))
+		return 2;
+
+	if (!ingest(&state))
+		return 2;
+
+	if (state.save_path && !save_file(&state))
+		return 2;
+
+	if (state.frame && !emit_frame(&state))
+		return 2;
+
+	// Tiles come after the final frame, from the same counts.
+	if (state.tile_path)
+		return render_tiles(&state) ? 0 : 2;
+
+	if (state.frame)
+		return 0;
+
 	render_image(&state);
 
 	return 0;
@@ -95,11 +310,114 @@ int main(int argc, char** argv)
 static bool parse_arguments(struct iphm_state* state, int argc, char** argv)
 {
 	state->bits = 18;
+	state->jobs = 1;
+	state->mode = DEDUP_AUTO;
+
+	state->files = calloc(argc, sizeof(struct iphm_file));
+	if (!state->files)
+		return false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:d:f:j:m:o:s:t:w:z:")) != -1)
+	{
+		char* endptr;
+		unsigned long int value;
+
+		switch (opt)
+		{
+			case 'b':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || (value != 4 && value != 5 && value != 8))
+				{
+					fprintf(stderr, "-b: invalid record size %s\n", optarg);
+					return false;
+				}
+				state->record_size = value;
+				break;
+			case 'c':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || !value)
+				{
+					fprintf(stderr, "-c: invalid address count %s\n", optarg);
+					return false;
+				}
+				state->frame_every = value;
+				break;
+			case 'd':
+				if (!strcmp(optarg, "auto"))
+					state->mode = DEDUP_AUTO;
+				else if (!strcmp(optarg, "bitmap"))
+					state->mode = DEDUP_BITMAP;
+				else if (!strcmp(optarg, "interval"))
+					state->mode = DEDUP_INTERVAL;
+				else
+				{
+					fprintf(stderr, "-d: invalid dedup mode %s\n", optarg);
+					return false;
+				}
+				break;
+			case 'f':
+				state->frame_path = optarg;
+				break;
+			case 'j':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || value < 1 || value > MAX_JOBS)
+				{
+					fprintf(stderr, "-j: invalid job count %s\n", optarg);
+					return false;
+				}
+				state->jobs = value;
+				break;
+			case 'm':
+				state->files[state->file_count].path = optarg;
+				state->files[state->file_count].fd = -1;
+				++state->file_count;
+				break;
+			case 'o':
+				state->save_path = optarg;
+				break;
+			case 's':
+				state->frame_seconds = strtod(optarg, &endptr);
+				if (*endptr || !(state->frame_seconds > 0.0))
+				{
+					fprintf(stderr, "-s: invalid interval %s\n", optarg);
+					return false;
+				}
+				break;
+			case 't':
+				state->tile_path = optarg;
+				break;
+			case 'w':
+				if (sscanf(optarg, "%u,%u,%u,%u%c", state->tile_window, state->tile_window + 1, state->tile_window + 2, state->tile_window + 3, (char[1]){}) != 4 ||
+					state->tile_window[0] > state->tile_window[2] ||
+					state->tile_window[1] > state->tile_window[3])
+				{
+					fprintf(stderr, "-w: invalid tile range %s\n", optarg);
+					return false;
+				}
+				state->tile_window_given = true;
+				break;
+			case 'z':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || value < 1 || value > 32)
+				{
+					fprintf(stderr, "-z: invalid level %s\n", optarg);
+					return false;
+				}
+				state->tile_level = value;
+				break;
+			default:
+				return false;
+		}
+	}
 
-	if (argc <= 1)
+	if (optind >= argc)
 		return true;
 
-	char* bstr = argv[1];
+	if (optind + 1 < argc)
+		return false;
+
+	char* bstr = argv[optind];
 	if (*bstr != '/')
 		return false;
 
@@ -110,241 +428,1689 @@ static bool parse_arguments(struct iphm_state* state, int argc, char** argv)
 		return false;
 
 	state->bits = value;
+	state->bits_given = true;
 	return true;
 }
 
-static bool prepare(struct iphm_state* state)
+static bool open_files(struct iphm_state* state)
 {
-	if (state->bits > 24)
-		state->handler = &bucket_handler_u8;
-	else if (state->bits > 16)
-		state->handler = &bucket_handler_u16;
-	else
-		state->handler = &bucket_handler_u32;
+	for (size_t i = 0u; i < state->file_count; ++i)
+	{
+		struct iphm_file* file = state->files + i;
 
-	state->bucket_size = (1UL << state->bits) * state->handler->value_size;
-	state->bucket = mmap(NULL, state->bucket_size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
-	if (state->bucket == MAP_FAILED)
-		return false;
+		file->fd = open(file->path, O_RDONLY);
+		if (file->fd < 0)
+		{
+			perror(file->path);
+			return false;
+		}
 
-	state->seen = mmap(NULL, SEEN_BYTESIZE, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
-	if (state->seen == MAP_FAILED)
-		return false;
+		struct stat st;
+		if (fstat(file->fd, &st))
+		{
+			perror(file->path);
+			return false;
+		}
+
+		const struct iphm_file_header* header = NULL;
+		if (st.st_size >= FILE_HEADER_SIZE)
+		{
+			file->size = st.st_size;
+			file->map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+			if (file->map == MAP_FAILED)
+			{
+				file->map = NULL;
+				perror(file->path);
+				return false;
+			}
+
+			header = file->map;
+		}
+
+		if (!header ||
+			memcmp(header->magic, FILE_MAGIC, sizeof(header->magic)) ||
+			header->bits < 1u || header->bits > 32u ||
+			header->data_size != file->size - FILE_HEADER_SIZE ||
+			!check_extents(file))
+		{
+			fprintf(stderr, "-m: %s is not an iphm state file\n", file->path);
+			return false;
+		}
+
+		// Without an explicit /N, the first state file decides.
+		if (!state->bits_given)
+		{
+			state->bits = header->bits;
+			state->bits_given = true;
+		}
+
+		if (header->bits != state->bits)
+		{
+			fprintf(stderr, "-m: %s was built with /%u, not /%u\n", file->path, header->bits, state->bits);
+			return false;
+		}
+	}
 
 	return true;
 }
 
-static bool read_address(struct iphm_state* state, struct cidr_address* address)
+static bool prepare(struct iphm_state* state)
 {
-	memset(address, 0, sizeof(struct cidr_address));
+	state->bucket_size = (1UL << state->bits) * state->engine->value_size;
+	if (state->bucket_size)
+	{
+		state->bucket = mmap(NULL, state->bucket_size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+		if (state->bucket == MAP_FAILED)
+			return false;
+	}
 
-	int c;
+	// Merged state files are bitmaps; keep ingesting on top of them.
+	if (state->file_count)
+		state->mode = DEDUP_BITMAP;
 
-consume_whitespace:
-	c = getchar();
-	switch (c)
+	// Live frames need counts as addresses arrive, which only the bitmap provides.
+	if (state->frame_seconds > 0.0 || state->frame_every)
 	{
-		case '\t':
-		case ' ':
-			goto consume_whitespace;
-		case EOF:
+		state->mode = DEDUP_BITMAP;
+		state->jobs = 1u;
+
+		state->frame_size = ((size_t)3u << state->bits);
+		state->frame = malloc(state->frame_size);
+		state->dirty_bits = calloc(((1UL << state->bits) + 63u) / 64u, sizeof(uint64_t));
+		state->dirty_capacity = (1UL << state->bits) / 8u;
+		if (state->dirty_capacity < 0x1000u)
+			state->dirty_capacity = 0x1000u;
+		state->dirty_list = malloc(state->dirty_capacity * sizeof(uintptr_t));
+		if (!state->frame || !state->dirty_bits || !state->dirty_list)
 			return false;
 	}
 
-	if (c == '#')
+	if (state->mode == DEDUP_BITMAP && !map_seen(state))
+		return false;
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->filled, NULL);
+	pthread_cond_init(&state->drained, NULL);
+
+	state->workers = calloc(state->jobs, sizeof(struct iphm_worker));
+	if (!state->workers)
+		return false;
+
+	for (uint32_t i = 0u; i < state->jobs; ++i)
 	{
-consume_comment:
-		c = getchar();
-		switch (c)
+		struct iphm_worker* worker = state->workers + i;
+		worker->state = state;
+		worker->seen = state->seen;
+
+		// Worker 0 counts straight into the final buckets, the others get their own.
+		if (!i || !state->bucket_size)
+			worker->bucket = state->bucket;
+		else
 		{
-			case '\n':
-				return true;
-			case EOF:
+			worker->bucket = mmap(NULL, state->bucket_size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+			if (worker->bucket == MAP_FAILED)
 				return false;
-			default:
-				goto consume_comment;
 		}
 	}
 
-	ungetc(c, stdin);
-
-	uint32_t values[5] = {};
-	for (uint32_t cval = 0; cval < 5; ++cval)
+	if (state->jobs == 1u)
 	{
-consume_value:
-		c = getchar();
-		switch (c)
-		{
-			case '\n':
-			case EOF:
-				if (cval == 3)
-				{
-					values[4] = 32u;
-					goto checkup;
-				}
-				else if (cval == 4)
-					goto checkup;
-				else
-					return c != EOF;
-			case '/':
-				if (cval == 3)
-					continue;
-				else
-					return true;
-			case '.':
-				if (cval < 4)
-					continue;
-				else
-					return true;
-			case '0':
-			case '1':
-			case '2':
-			case '3':
-			case '4':
-			case '5':
-			case '6':
-			case '7':
-			case '8':
-			case '9':
-				values[cval] = (values[cval] * 10u) + (c - '0');
-				goto consume_value;
-			default:
-				return true;
-		}
+		state->workers->input = malloc(INPUT_BLOCK_SIZE);
+		return state->workers->input != NULL;
 	}
 
-checkup:
-	if (values[0] > 255u ||
-		values[1] > 255u ||
-		values[2] > 255u ||
-		values[3] > 255u ||
-		values[4] > 32u)
-		return true;
-
-	address->address = (values[0] << 24) | (values[1] << 16) | (values[2] << 8) | values[3];
-	address->count = values[4];
-	return true;
-}
-
-static void add_address(struct iphm_state* state, const struct cidr_address* address)
-{
-	if (!address->count)
-		return;
+	state->chunk_count = state->jobs * 2u;
+	state->chunks = calloc(state->chunk_count, sizeof(struct iphm_chunk));
+	if (!state->chunks)
+		return false;
 
-	if (address->count >= 32u)
+	for (size_t i = 0u; i < state->chunk_count; ++i)
 	{
-		add_address_single(state, address->address);
-		return;
+		struct iphm_chunk* chunk = state->chunks + i;
+		chunk->capacity = INPUT_BLOCK_SIZE;
+		chunk->data = malloc(chunk->capacity);
+		if (!chunk->data)
+			return false;
 	}
 
-	uint32_t count = 1u << (32u - address->count);
-	uint32_t base = address->address & ~(count - 1u);
-
-	for (uint32_t i = 0; i < count; ++i)
-		add_address_single(state, base | i);
+	return true;
 }
 
-static void add_address_single(struct iphm_state* state, uint32_t address)
+static bool ingest(struct iphm_state* state)
 {
-	const uintptr_t ptr_one = 1u;
-	const size_t ptr_bits = sizeof(uintptr_t) * 8u;
-
-	uint32_t seen_index = address / ptr_bits;
-	uint32_t seen_offset = address % ptr_bits;
-	uintptr_t seen_mask = ptr_one << seen_offset;
-
-	uint32_t bucket_index = address >> (32u - state->bits);
-	uintptr_t bucket_addend = ((state->seen[seen_index] & seen_mask) >> seen_offset) ^ ptr_one;
-	state->seen[seen_index] |= seen_mask;
+	if (state->jobs == 1u)
+		state->engine->ingest(state->workers);
+	else
+	{
+		for (uint32_t i = 0u; i < state->jobs; ++i)
+		{
+			struct iphm_worker* worker = state->workers + i;
+			if (pthread_create(&worker->thread, NULL, ingest_thread, worker))
+			{
+				perror("pthread_create");
+				return false;
+			}
+			worker->started = true;
+		}
 
-	state->handler->add_value(state, bucket_index, bucket_addend);
-}
+		bool result = split_input(state);
 
-static uintptr_t bucket_u8_get(struct iphm_state* state, uintptr_t index)
-{
-	return state->bucket_u8[index];
-}
+		for (uint32_t i = 0u; i < state->jobs; ++i)
+		{
+			struct iphm_worker* worker = state->workers + i;
+			pthread_join(worker->thread, NULL);
+			worker->started = false;
+		}
 
-static void bucket_u8_add(struct iphm_state* state, uintptr_t index, uintptr_t value)
-{
-	state->bucket_u8[index] += value;
-}
+		if (!result)
+			return false;
+	}
 
-static uintptr_t bucket_u16_get(struct iphm_state* state, uintptr_t index)
-{
-	return state->bucket_u16[index];
-}
+	if (state->frame_failed)
+		return false;
 
-static void bucket_u16_add(struct iphm_state* state, uintptr_t index, uintptr_t value)
-{
-	state->bucket_u16[index] += value;
+	state->engine->merge(state);
+	return true;
 }
 
-static uintptr_t bucket_u32_get(struct iphm_state* state, uintptr_t index)
+static void* ingest_thread(void* arg)
 {
-	return state->bucket_u32[index];
+	struct iphm_worker* worker = arg;
+	worker->state->engine->ingest(worker);
+	return NULL;
 }
 
-static void bucket_u32_add(struct iphm_state* state, uintptr_t index, uintptr_t value)
+static inline __attribute((always_inline)) void ingest_worker(struct iphm_worker* worker, size_t value_size)
 {
-	state->bucket_u32[index] += value;
-}
+	struct iphm_state* state = worker->state;
 
-static void generate_palette(struct iphm_state* state)
-{
-	for (uint32_t i = 0u; i < 256u; ++i)
+	struct cidr_address address;
+	while (read_address(worker, &address))
 	{
-		struct rgbx* p = state->palette + i;
+		add_address(worker, &address, value_size);
 
-		p->r = i >= 128u ? 255u : i * 2u;
-
-		uint32_t j = i ^ 255u;
-		p->g = j >= 128u ? 255u : j * 2u;
-
-		p->b = 0u;
-		p->x = 255u;
+		if (state->frame_every && address.count && ++state->frame_added >= state->frame_every)
+		{
+			state->frame_added = 0u;
+			if (!emit_frame(state))
+			{
+				state->frame_failed = true;
+				return;
+			}
+		}
 	}
 }
 
-static void render_image(struct iphm_state* state)
+// Hands stdin to the workers in chunks that end on a line boundary.
+static bool split_input(struct iphm_state* state)
 {
-	uint32_t width = 1u << ((state->bits / 2u) + (state->bits & 1u));
-	uint32_t height = 1u << (state->bits / 2u);
-
-	double max = 1u << (32u - state->bits);
-
-	printf("P6\n%u %u 255\n", width, height);
-
-	uint32_t x, y;
-	uint32_t* dispatch[2] = { &x, &y };
+	uint8_t* carry = NULL;
+	size_t carry_size = 0u;
+	bool result = true;
+	bool eof = false;
 
-	for (y = 0u; y < height; ++y)
+	while (!eof)
 	{
-		for (x = 0u; x < width; ++x)
+		pthread_mutex_lock(&state->lock);
+		struct iphm_chunk* chunk = state->chunks + state->produced % state->chunk_count;
+		while (chunk->busy)
+			pthread_cond_wait(&state->drained, &state->lock);
+		pthread_mutex_unlock(&state->lock);
+
+		memcpy(chunk->data, carry, carry_size);
+		size_t size = carry_size;
+		uint8_t* newline = NULL;
+		bool boundary = state->record_size && size >= state->record_size;
+
+		for (;;)
 		{
-			uintptr_t index = 0u;
-			for (uint32_t i = 0u; i < state->bits; ++i)
+			if (size == chunk->capacity)
 			{
-				uint32_t* value = dispatch[i & 1u];
-				uint32_t bit = (*value >> (i / 2u)) & 1u;
-				index |= bit << i;
-			}
+				if (boundary)
+					break;
 
-			uintptr_t raw_value = state->handler->get_value(state, index);
+				// A single line longer than the chunk: grow it rather than split the line.
+				uint8_t* data = realloc(chunk->data, chunk->capacity * 2u);
+				if (!data)
+				{
+					perror("realloc");
+					result = false;
+					eof = true;
+					break;
+				}
 
-			double scaled = raw_value / max;
+				chunk->data = data;
+				chunk->capacity *= 2u;
+			}
 
-			uint32_t value = (uint32_t)round(scaled * 255.0);
+			ssize_t count = read(STDIN_FILENO, chunk->data + size, chunk->capacity - size);
+			if (count < 0 && errno == EINTR)
+				continue;
+			if (count <= 0)
+			{
+				eof = true;
+				break;
+			}
 
-			putchar(state->palette[value].r);
-			putchar(state->palette[value].g);
-			putchar(state->palette[value].b);
+			if (!boundary && !state->record_size)
+				boundary = memchr(chunk->data + size, '\n', count) != NULL;
+			size += count;
+			boundary = boundary || (state->record_size && size >= state->record_size);
 		}
-	}
-}
 
-static void cleanup(struct iphm_state* state)
-{
+		carry_size = 0u;
+		if (!eof)
+		{
+			// Binary records are cut on a record boundary instead of a newline.
+			if (state->record_size)
+				newline = chunk->data + size - size % state->record_size - 1;
+			else
+				newline = memrchr(chunk->data, '\n', size);
+			carry_size = chunk->data + size - (newline + 1);
+
+			uint8_t* data = realloc(carry, carry_size);
+			if (carry_size && !data)
+			{
+				perror("realloc");
+				result = false;
+				eof = true;
+				carry_size = 0u;
+			}
+			else
+			{
+				carry = data;
+				memcpy(carry, newline + 1, carry_size);
+				size -= carry_size;
+			}
+		}
+
+		pthread_mutex_lock(&state->lock);
+		chunk->size = size;
+		chunk->busy = true;
+		++state->produced;
+		state->input_done = eof;
+		pthread_cond_broadcast(&state->filled);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	free(carry);
+	return result;
+}
+
+static inline __attribute((always_inline)) void merge_workers(struct iphm_state* state, size_t value_size)
+{
+	struct iphm_worker* main_worker = state->workers;
+
+	for (uint32_t i = 1u; i < state->jobs; ++i)
+	{
+		struct iphm_worker* worker = state->workers + i;
+
+		for (uintptr_t j = 0u, count = value_size ? 1UL << state->bits : 0u; j < count; ++j)
+		{
+			uintptr_t value = bucket_get(worker->bucket, j, value_size);
+			if (value)
+				bucket_add(state->bucket, j, value, value_size);
+		}
+
+		if (!worker->range_count)
+			continue;
+
+		// Collect leftover intervals into the first worker, which finishes them below.
+		if (main_worker->range_capacity < main_worker->range_count + worker->range_count)
+		{
+			size_t capacity = main_worker->range_count + worker->range_count;
+			struct ip_range* ranges = realloc(main_worker->ranges, capacity * sizeof(struct ip_range));
+			if (!ranges)
+			{
+				perror("realloc");
+				exit(2);
+			}
+
+			main_worker->ranges = ranges;
+			main_worker->range_capacity = capacity;
+		}
+
+		memcpy(main_worker->ranges + main_worker->range_count, worker->ranges, worker->range_count * sizeof(struct ip_range));
+		main_worker->range_count += worker->range_count;
+		worker->range_count = 0u;
+	}
+
+	if (state->seen)
+	{
+		main_worker->seen = state->seen;
+		for (size_t i = 0u; i < main_worker->range_count; ++i)
+			add_range(main_worker, main_worker->ranges[i].first, (uint64_t)main_worker->ranges[i].last - main_worker->ranges[i].first + 1u, value_size);
+		main_worker->range_count = 0u;
+	}
+	else
+		count_intervals(main_worker, value_size);
+}
+
+static void load_files(struct iphm_state* state)
+{
+	for (size_t i = 0u; i < state->file_count; ++i)
+		state->engine->load(state, state->files + i);
+}
+
+// ORs one state file into the bitmap and credits the buckets for newly set bits only, which rebuilds them from scratch for the first file.
+static inline __attribute((always_inline)) void load_file(struct iphm_state* state, const struct iphm_file* file, size_t value_size)
+{
+	const struct iphm_file_header* header = file->map;
+	const uint32_t bucket_shift = 32u - state->bits;
+	const uint8_t* data = (const uint8_t*)file->map + FILE_HEADER_SIZE;
+
+	for (uint64_t i = 0u; i < header->extent_count; ++i)
+	{
+		struct iphm_extent extent;
+		memcpy(&extent, data, sizeof(extent));
+		data += sizeof(extent);
+
+		bool full = extent.count & EXTENT_FULL;
+		uint32_t count = extent.count & ~EXTENT_FULL;
+
+		for (uint32_t j = 0u; j < count; ++j)
+		{
+			uint64_t incoming = ~0ull;
+			if (!full)
+			{
+				memcpy(&incoming, data, sizeof(uint64_t));
+				data += sizeof(uint64_t);
+			}
+
+			uint32_t index = extent.first + j;
+			uint64_t fresh = incoming & ~state->seen[index];
+			if (!fresh)
+				continue;
+
+			state->seen[index] |= fresh;
+			credit_word(state->workers, bucket_shift, index, fresh, value_size);
+		}
+	}
+}
+
+// Walks the extents once, so that loading can trust them.
+static bool check_extents(const struct iphm_file* file)
+{
+	const struct iphm_file_header* header = file->map;
+	const uint8_t* data = (const uint8_t*)file->map + FILE_HEADER_SIZE;
+	const uint8_t* end = data + header->data_size;
+	uint64_t next = 0u;
+
+	for (uint64_t i = 0u; i < header->extent_count; ++i)
+	{
+		struct iphm_extent extent;
+		if ((size_t)(end - data) < sizeof(extent))
+			return false;
+
+		memcpy(&extent, data, sizeof(extent));
+		data += sizeof(extent);
+
+		uint64_t count = extent.count & ~EXTENT_FULL;
+		if (!count || extent.first < next || extent.first + count > SEEN_BYTESIZE / sizeof(uint64_t))
+			return false;
+		next = extent.first + count;
+
+		if (!(extent.count & EXTENT_FULL))
+		{
+			if ((size_t)(end - data) / sizeof(uint64_t) < count)
+				return false;
+			data += count * sizeof(uint64_t);
+		}
+	}
+
+	return data == end;
+}
+
+static bool save_file(struct iphm_state* state)
+{
+	size_t path_size = strlen(state->save_path) + 8u;
+	char* path = malloc(path_size);
+	if (!path)
+	{
+		perror("malloc");
+		return false;
+	}
+
+	// Write next to the target and rename, so a state file can be merged into itself.
+	snprintf(path, path_size, "%s.XXXXXX", state->save_path);
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		perror(path);
+		free(path);
+		return false;
+	}
+
+	// mkstemp creates the file 0600; give it the usual permissions.
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	// The interval backend never needed the bitmap; it is only filled in now, which touches just the pages in use.
+	if (!state->seen)
+	{
+		if (!map_seen(state))
+		{
+			perror("mmap");
+			close(fd);
+			unlink(path);
+			free(path);
+			return false;
+		}
+
+		const struct iphm_worker* worker = state->workers;
+		for (size_t i = 0u; i < worker->range_count; ++i)
+			set_bits(state->seen, worker->ranges[i].first, (uint64_t)worker->ranges[i].last - worker->ranges[i].first + 1u);
+	}
+
+	FILE* file = fdopen(fd, "wb");
+	if (!file)
+	{
+		perror(path);
+		close(fd);
+		unlink(path);
+		free(path);
+		return false;
+	}
+
+	// Buckets are not stored: loading rebuilds them from the bitmap, so only its non-zero words take space.
+	struct iphm_file_header header = { .bits = state->bits };
+	memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+	bool result = fwrite(&header, sizeof(header), 1u, file) == 1u;
+
+	const uint64_t* words = state->seen;
+	const size_t word_count = SEEN_BYTESIZE / sizeof(uint64_t);
+	for (size_t i = 0u; result && i < word_count;)
+	{
+		if (!words[i])
+		{
+			++i;
+			continue;
+		}
+
+		// Two or more full words in a row make a payload-free extent; anything else non-zero is stored as is.
+		size_t j = i;
+		bool full = words[i] == ~0ull && i + 1u < word_count && words[i + 1u] == ~0ull;
+		if (full)
+		{
+			while (j < word_count && words[j] == ~0ull)
+				++j;
+		}
+		else
+		{
+			while (j < word_count && words[j] && !(words[j] == ~0ull && j + 1u < word_count && words[j + 1u] == ~0ull))
+				++j;
+		}
+
+		struct iphm_extent extent = { i, (j - i) | (full ? EXTENT_FULL : 0u) };
+		result = fwrite(&extent, sizeof(extent), 1u, file) == 1u &&
+			(full || fwrite(words + i, sizeof(uint64_t), j - i, file) == j - i);
+
+		++header.extent_count;
+		header.data_size += sizeof(extent) + (full ? 0u : (j - i) * sizeof(uint64_t));
+		i = j;
+	}
+
+	result = result && !fseek(file, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1u, file) == 1u;
+	result = !fclose(file) && result;
+	result = result && !rename(path, state->save_path);
+
+	if (!result)
+	{
+		perror(state->save_path);
+		unlink(path);
+	}
+
+	free(path);
+	return result;
+}
+
+static void set_bits(uint64_t* words, uint32_t first, uint64_t count)
+{
+	uint64_t position = first;
+	uint64_t end = position + count;
+
+	while (position < end)
+	{
+		uint32_t index = position / 64u;
+		uint64_t word_base = (uint64_t)index * 64u;
+		uint32_t low = position - word_base;
+		uint32_t high = end - word_base < 64u ? end - word_base : 64u;
+
+		words[index] |= (high == 64u ? ~0ull : (1ull << high) - 1u) & (~0ull << low);
+		position = word_base + high;
+	}
+}
+
+static bool read_address(struct iphm_worker* worker, struct cidr_address* address)
+{
+	memset(address, 0, sizeof(struct cidr_address));
+
+	if (worker->state->record_size)
+		return read_record(worker, address);
+
+	if (worker->input_size - worker->input_offset >= ADDRESS_MAX_LENGTH && read_address_fast(worker, address))
+		return true;
+
+	int c;
+
+consume_whitespace:
+	c = input_getc(worker);
+	switch (c)
+	{
+		case '\t':
+		case ' ':
+			goto consume_whitespace;
+		case EOF:
+			return false;
+	}
+
+	if (c == '#')
+	{
+consume_comment:
+		c = input_getc(worker);
+		switch (c)
+		{
+			case '\n':
+				return true;
+			case EOF:
+				return false;
+			default:
+				goto consume_comment;
+		}
+	}
+
+	--worker->input_offset;
+
+	uint32_t values[5] = {};
+	for (uint32_t cval = 0; cval < 5; ++cval)
+	{
+consume_value:
+		c = input_getc(worker);
+		switch (c)
+		{
+			case '\n':
+			case EOF:
+				if (cval == 3)
+				{
+					values[4] = 32u;
+					goto checkup;
+				}
+				else if (cval == 4)
+					goto checkup;
+				else
+					return c != EOF;
+			case '/':
+				if (cval == 3)
+					continue;
+				else
+					return true;
+			case '.':
+				if (cval < 4)
+					continue;
+				else
+					return true;
+			case '0':
+			case '1':
+			case '2':
+			case '3':
+			case '4':
+			case '5':
+			case '6':
+			case '7':
+			case '8':
+			case '9':
+				values[cval] = (values[cval] * 10u) + (c - '0');
+				goto consume_value;
+			default:
+				return true;
+		}
+	}
+
+checkup:
+	if (values[0] > 255u ||
+		values[1] > 255u ||
+		values[2] > 255u ||
+		values[3] > 255u ||
+		values[4] > 32u)
+		return true;
+
+	address->address = (values[0] << 24) | (values[1] << 16) | (values[2] << 8) | values[3];
+	address->count = values[4];
+	return true;
+}
+
+// Plain dotted quads with an optional prefix, fully inside the block; anything else takes the slow path.
+static bool read_address_fast(struct iphm_worker* worker, struct cidr_address* address)
+{
+	const uint8_t* p = worker->input + worker->input_offset;
+
+	uint32_t values[5];
+	for (uint32_t cval = 0; cval < 4; ++cval)
+	{
+		uint32_t digit = p[0] - '0';
+		if (digit > 9u)
+			return false;
+
+		uint32_t value = digit;
+		digit = p[1] - '0';
+		if (digit <= 9u)
+		{
+			value = value * 10u + digit;
+			digit = p[2] - '0';
+			if (digit <= 9u)
+			{
+				value = value * 10u + digit;
+				++p;
+			}
+			++p;
+		}
+		++p;
+
+		values[cval] = value;
+
+		if (cval < 3)
+		{
+			if (*p != '.')
+				return false;
+			++p;
+		}
+	}
+
+	values[4] = 32u;
+	if (*p == '/')
+	{
+		uint32_t digit = p[1] - '0';
+		if (digit > 9u)
+			return false;
+
+		values[4] = digit;
+		digit = p[2] - '0';
+		if (digit <= 9u)
+		{
+			values[4] = values[4] * 10u + digit;
+			++p;
+		}
+		p += 2;
+	}
+
+	if (*p != '\n')
+		return false;
+
+	worker->input_offset = p + 1 - worker->input;
+
+	if ((values[0] | values[1] | values[2] | values[3]) > 255u || values[4] > 32u)
+		return true;
+
+	address->address = (values[0] << 24) | (values[1] << 16) | (values[2] << 8) | values[3];
+	address->count = values[4];
+	return true;
+}
+
+// Big-endian address, optionally followed by a one-byte or big-endian four-byte prefix.
+static bool read_record(struct iphm_worker* worker, struct cidr_address* address)
+{
+	const uint32_t record_size = worker->state->record_size;
+
+	uint8_t buffer[8];
+	const uint8_t* record;
+
+	if (worker->input_size - worker->input_offset >= record_size)
+	{
+		record = worker->input + worker->input_offset;
+		worker->input_offset += record_size;
+	}
+	else
+	{
+		// Records straddling a block boundary; a truncated last record is dropped.
+		for (uint32_t i = 0u; i < record_size; ++i)
+		{
+			int c = input_getc(worker);
+			if (c == EOF)
+				return false;
+			buffer[i] = c;
+		}
+		record = buffer;
+	}
+
+	uint32_t value = (uint32_t)record[0] << 24 | (uint32_t)record[1] << 16 | (uint32_t)record[2] << 8 | record[3];
+
+	uint32_t count = 32u;
+	if (record_size == 5u)
+		count = record[4];
+	else if (record_size == 8u)
+		count = (uint32_t)record[4] << 24 | (uint32_t)record[5] << 16 | (uint32_t)record[6] << 8 | record[7];
+
+	if (count > 32u)
+		return true;
+
+	address->address = value;
+	address->count = count;
+	return true;
+}
+
+static inline int input_getc(struct iphm_worker* worker)
+{
+	if (worker->input_offset == worker->input_size && !input_fill(worker))
+		return EOF;
+
+	return worker->input[worker->input_offset++];
+}
+
+static bool input_fill(struct iphm_worker* worker)
+{
+	if (worker->input_eof)
+		return false;
+
+	struct iphm_state* state = worker->state;
+
+	if (state->jobs == 1u)
+	{
+		// A frame that cannot be written ends the input, and ingest reports it.
+		if (state->frame_seconds > 0.0 && !wait_for_input(state))
+		{
+			state->frame_failed = true;
+			worker->input_eof = true;
+			return false;
+		}
+
+		ssize_t result;
+		do
+			result = read(STDIN_FILENO, worker->input, INPUT_BLOCK_SIZE);
+		while (result < 0 && errno == EINTR);
+
+		if (result <= 0)
+		{
+			worker->input_eof = true;
+			return false;
+		}
+
+		worker->input_offset = 0u;
+		worker->input_size = result;
+		return true;
+	}
+
+	// Chunks end on a line boundary, so records never continue into the next one.
+	pthread_mutex_lock(&state->lock);
+
+	if (worker->chunk)
+	{
+		worker->chunk->busy = false;
+		worker->chunk = NULL;
+		pthread_cond_signal(&state->drained);
+	}
+
+	while (state->taken == state->produced && !state->input_done)
+		pthread_cond_wait(&state->filled, &state->lock);
+
+	if (state->taken == state->produced)
+	{
+		pthread_mutex_unlock(&state->lock);
+		worker->input_eof = true;
+		worker->input = NULL;
+		worker->input_offset = 0u;
+		worker->input_size = 0u;
+		return false;
+	}
+
+	worker->chunk = state->chunks + state->taken++ % state->chunk_count;
+	pthread_mutex_unlock(&state->lock);
+
+	worker->input = worker->chunk->data;
+	worker->input_offset = 0u;
+	worker->input_size = worker->chunk->size;
+	return true;
+}
+
+static inline __attribute((always_inline)) void add_address(struct iphm_worker* worker, const struct cidr_address* address, size_t value_size)
+{
+	if (!address->count)
+		return;
+
+	uint64_t count = 1ull << (32u - address->count);
+	uint32_t base = address->address & ~(uint32_t)(count - 1u);
+
+	if (worker->seen)
+		add_range(worker, base, count, value_size);
+	else if (!add_interval(worker, base, count))
+	{
+		// Too many disjoint ranges to keep as intervals: fall back to the bitmap.
+		if (!spill_intervals(worker, value_size))
+		{
+			perror("mmap");
+			exit(2);
+		}
+
+		add_range(worker, base, count, value_size);
+	}
+}
+
+static bool map_seen(struct iphm_state* state)
+{
+	state->seen = mmap(NULL, SEEN_BYTESIZE, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+	if (state->seen == MAP_FAILED)
+	{
+		state->seen = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static inline __attribute((always_inline)) bool spill_intervals(struct iphm_worker* worker, size_t value_size)
+{
+	struct iphm_state* state = worker->state;
+
+	pthread_mutex_lock(&state->lock);
+	bool result = state->seen || map_seen(state);
+	worker->seen = state->seen;
+	pthread_mutex_unlock(&state->lock);
+
+	if (!result)
+		return false;
+
+	for (size_t i = 0u; i < worker->range_count; ++i)
+		add_range(worker, worker->ranges[i].first, (uint64_t)worker->ranges[i].last - worker->ranges[i].first + 1u, value_size);
+
+	free(worker->ranges);
+	worker->ranges = NULL;
+	worker->range_count = 0u;
+	worker->range_capacity = 0u;
+	return true;
+}
+
+static inline __attribute((always_inline)) void add_range(struct iphm_worker* worker, uint32_t first, uint64_t count, size_t value_size)
+{
+	const struct iphm_state* state = worker->state;
+	const uint32_t word_bits = 64u;
+	const uint32_t bucket_shift = 32u - state->bits;
+	const bool shared = state->jobs > 1u;
+
+	uint64_t position = first;
+	uint64_t end = position + count;
+
+	uintptr_t bucket_index = 0u;
+	uintptr_t bucket_addend = 0u;
+
+	while (position < end)
+	{
+		uint32_t seen_index = position / word_bits;
+		uint64_t word_base = (uint64_t)seen_index * word_bits;
+		uint32_t low = position - word_base;
+		uint32_t high = end - word_base < word_bits ? end - word_base : word_bits;
+
+		uint64_t seen_mask = (high == word_bits ? ~0ull : (1ull << high) - 1u) & (~0ull << low);
+		uint64_t fresh;
+
+		// Only the thread that actually flips a bit gets to count it.
+		if (shared)
+			fresh = seen_mask & ~__atomic_fetch_or(worker->seen + seen_index, seen_mask, __ATOMIC_RELAXED);
+		else
+		{
+			fresh = seen_mask & ~worker->seen[seen_index];
+			worker->seen[seen_index] |= seen_mask;
+		}
+
+		position = word_base + high;
+
+		if (!fresh)
+			continue;
+
+		// Buckets of at least a word: credit each bucket once per range.
+		if (bucket_shift >= 6u)
+		{
+			uintptr_t index = seen_index >> (bucket_shift - 6u);
+			if (index != bucket_index && bucket_addend)
+			{
+				bucket_add(worker->bucket, bucket_index, bucket_addend, value_size);
+				mark_dirty(worker->state, bucket_index);
+				bucket_addend = 0u;
+			}
+
+			bucket_index = index;
+			bucket_addend += __builtin_popcountll(fresh);
+			continue;
+		}
+
+		credit_word(worker, bucket_shift, seen_index, fresh, value_size);
+	}
+
+	if (bucket_addend)
+	{
+		bucket_add(worker->bucket, bucket_index, bucket_addend, value_size);
+		mark_dirty(worker->state, bucket_index);
+	}
+}
+
+static inline __attribute((always_inline)) void credit_word(struct iphm_worker* worker, uint32_t bucket_shift, uint32_t seen_index, uint64_t fresh, size_t value_size)
+{
+	uint64_t word_base = (uint64_t)seen_index * 64u;
+
+	if (bucket_shift >= 6u)
+	{
+		bucket_add(worker->bucket, word_base >> bucket_shift, __builtin_popcountll(fresh), value_size);
+		mark_dirty(worker->state, word_base >> bucket_shift);
+		return;
+	}
+
+	uint32_t bucket_width = 1u << bucket_shift;
+	uint64_t bucket_mask = (1ull << bucket_width) - 1u;
+
+	while (fresh)
+	{
+		uint32_t sub = __builtin_ctzll(fresh) >> bucket_shift;
+		uint64_t mask = bucket_mask << (sub * bucket_width);
+
+		bucket_add(worker->bucket, (word_base >> bucket_shift) + sub, __builtin_popcountll(fresh & mask), value_size);
+		mark_dirty(worker->state, (word_base >> bucket_shift) + sub);
+		fresh &= ~mask;
+	}
+}
+
+static inline void mark_dirty(struct iphm_state* state, uintptr_t index)
+{
+	if (!state->dirty_bits || state->dirty_all)
+		return;
+
+	uint64_t bit = 1ull << (index % 64u);
+	if (state->dirty_bits[index / 64u] & bit)
+		return;
+
+	// Past the list capacity, the next frame is simply redrawn in full.
+	if (state->dirty_count == state->dirty_capacity)
+	{
+		state->dirty_all = true;
+		return;
+	}
+
+	state->dirty_bits[index / 64u] |= bit;
+	state->dirty_list[state->dirty_count++] = index;
+}
+
+static bool add_interval(struct iphm_worker* worker, uint32_t first, uint64_t count)
+{
+	if (worker->range_count == worker->range_capacity)
+	{
+		if (worker->range_count >= RANGE_LIMIT)
+		{
+			coalesce_intervals(worker);
+
+			if (worker->state->mode == DEDUP_AUTO && worker->range_count >= RANGE_LIMIT / 2u)
+				return false;
+		}
+
+		if (worker->range_count == worker->range_capacity)
+		{
+			size_t capacity = worker->range_capacity ? worker->range_capacity * 2u : 0x1000u;
+			struct ip_range* ranges = realloc(worker->ranges, capacity * sizeof(struct ip_range));
+			if (!ranges)
+				return false;
+
+			worker->ranges = ranges;
+			worker->range_capacity = capacity;
+		}
+	}
+
+	struct ip_range* range = worker->ranges + worker->range_count++;
+	range->first = first;
+	range->last = first + (uint32_t)(count - 1u);
+	return true;
+}
+
+static int compare_ranges(const void* a, const void* b)
+{
+	const struct ip_range* ra = a;
+	const struct ip_range* rb = b;
+
+	if (ra->first != rb->first)
+		return ra->first < rb->first ? -1 : 1;
+
+	if (ra->last != rb->last)
+		return ra->last < rb->last ? -1 : 1;
+
+	return 0;
+}
+
+static void coalesce_intervals(struct iphm_worker* worker)
+{
+	if (!worker->range_count)
+		return;
+
+	qsort(worker->ranges, worker->range_count, sizeof(struct ip_range), compare_ranges);
+
+	struct ip_range* out = worker->ranges;
+	for (size_t i = 1u; i < worker->range_count; ++i)
+	{
+		const struct ip_range* range = worker->ranges + i;
+		if ((uint64_t)range->first <= (uint64_t)out->last + 1u)
+		{
+			if (range->last > out->last)
+				out->last = range->last;
+		}
+		else
+			*++out = *range;
+	}
+
+	worker->range_count = out - worker->ranges + 1u;
+}
+
+static inline __attribute((always_inline)) void count_intervals(struct iphm_worker* worker, size_t value_size)
+{
+	const struct iphm_state* state = worker->state;
+	const uint32_t bucket_shift = 32u - state->bits;
+
+	coalesce_intervals(worker);
+
+	for (size_t i = 0u; i < worker->range_count; ++i)
+	{
+		uint64_t position = worker->ranges[i].first;
+		uint64_t end = (uint64_t)worker->ranges[i].last + 1u;
+
+		while (position < end)
+		{
+			uintptr_t bucket_index = position >> bucket_shift;
+			uint64_t bucket_end = (uint64_t)(bucket_index + 1u) << bucket_shift;
+			if (bucket_end > end)
+				bucket_end = end;
+
+			bucket_add(worker->bucket, bucket_index, bucket_end - position, value_size);
+			position = bucket_end;
+		}
+	}
+}
+
+static inline __attribute((always_inline)) uintptr_t bucket_get(const void* bucket, uintptr_t index, size_t value_size)
+{
+	switch (value_size)
+	{
+		case 0u:
+			return 0u;
+		case sizeof(uint8_t):
+			return ((const uint8_t*)bucket)[index];
+		case sizeof(uint16_t):
+			return ((const uint16_t*)bucket)[index];
+		default:
+			return ((const uint32_t*)bucket)[index];
+	}
+}
+
+static inline __attribute((always_inline)) void bucket_add(void* bucket, uintptr_t index, uintptr_t value, size_t value_size)
+{
+	if (!value_size)
+		return;
+
+	// Saturate rather than wrap, should a count ever exceed the bucket width.
+	uint64_t limit = (1ull << (value_size * 8u)) - 1u;
+	uint64_t sum = bucket_get(bucket, index, value_size) + (uint64_t)value;
+	if (sum > limit)
+		sum = limit;
+
+	switch (value_size)
+	{
+		case sizeof(uint8_t):
+			((uint8_t*)bucket)[index] = sum;
+			break;
+		case sizeof(uint16_t):
+			((uint16_t*)bucket)[index] = sum;
+			break;
+		default:
+			((uint32_t*)bucket)[index] = sum;
+			break;
+	}
+}
+
+static void generate_palette(struct iphm_state* state)
+{
+	for (uint32_t i = 0u; i < 256u; ++i)
+	{
+		struct rgbx* p = state->palette + i;
+
+		p->r = i >= 128u ? 255u : i * 2u;
+
+		uint32_t j = i ^ 255u;
+		p->g = j >= 128u ? 255u : j * 2u;
+
+		p->b = 0u;
+		p->x = 255u;
+	}
+}
+
+static void generate_tables(struct iphm_state* state)
+{
+	for (uint32_t i = 0u; i < 256u; ++i)
+	{
+		uint16_t spread = 0u;
+		for (uint32_t j = 0u; j < 8u; ++j)
+			spread |= ((i >> j) & 1u) << (j * 2u);
+
+		state->morton[i] = spread;
+	}
+
+	// Narrow buckets map straight to a palette entry; wider ones use the same rounding in integers.
+	uint32_t shift = 32u - state->bits;
+	if (shift > 16u)
+		return;
+
+	state->shade = malloc((1u << shift) + 1u);
+	if (!state->shade)
+		return;
+
+	for (uint32_t raw = 0u; raw <= 1u << shift; ++raw)
+		state->shade[raw] = ((uint64_t)raw * 255u + ((1ull << shift) >> 1)) >> shift;
+}
+
+static void render_image(struct iphm_state* state)
+{
+	uint32_t width = 1u << ((state->bits / 2u) + (state->bits & 1u));
+	uint32_t height = 1u << (state->bits / 2u);
+
+	printf("P6\n%u %u 255\n", width, height);
+
+	size_t row_size = (size_t)width * 3u;
+	uint32_t batch_rows = RENDER_BATCH_SIZE / row_size;
+	if (!batch_rows)
+		batch_rows = 1u;
+	if (batch_rows > height)
+		batch_rows = height;
+
+	uint8_t* out = malloc(row_size * batch_rows);
+	if (!out)
+	{
+		perror("malloc");
+		return;
+	}
+
+	struct iphm_render renders[MAX_JOBS] = {};
+
+	for (uint32_t y = 0u; y < height; y += batch_rows)
+	{
+		uint32_t rows = height - y < batch_rows ? height - y : batch_rows;
+		uint32_t jobs = state->jobs < rows ? state->jobs : rows;
+
+		// Each thread renders a contiguous band of the batch.
+		for (uint32_t i = 0u, row = 0u; i < jobs; ++i)
+		{
+			struct iphm_render* render = renders + i;
+			render->state = state;
+			render->first_row = y + row;
+			render->row_count = rows / jobs + (i < rows % jobs);
+			render->out = out + row * row_size;
+			row += render->row_count;
+
+			render->started = i && !pthread_create(&render->thread, NULL, render_thread, render);
+		}
+
+		for (uint32_t i = 0u; i < jobs; ++i)
+		{
+			if (renders[i].started)
+				pthread_join(renders[i].thread, NULL);
+			else
+				state->engine->render(renders + i);
+		}
+
+		fwrite(out, row_size, rows, stdout);
+	}
+
+	free(out);
+}
+
+static void* render_thread(void* arg)
+{
+	struct iphm_render* render = arg;
+	render->state->engine->render(render);
+	return NULL;
+}
+
+static inline __attribute((always_inline)) void render_rows(struct iphm_render* render, size_t value_size)
+{
+	const struct iphm_state* state = render->state;
+	const uint16_t* morton = state->morton;
+	const uint32_t width = 1u << ((state->bits / 2u) + (state->bits & 1u));
+
+	uint8_t* out = render->out;
+
+	for (uint32_t y = render->first_row, end = y + render->row_count; y < end; ++y)
+	{
+		uint32_t y_index = ((uint32_t)morton[y & 255u] | (uint32_t)morton[y >> 8] << 16) << 1;
+
+		for (uint32_t x = 0u; x < width; ++x)
+		{
+			uint32_t index = y_index | morton[x & 255u] | (uint32_t)morton[x >> 8] << 16;
+			uintptr_t raw_value = bucket_get(state->bucket, index, value_size);
+
+			const struct rgbx* color = state->palette + shade(state, raw_value);
+			out[0] = color->r;
+			out[1] = color->g;
+			out[2] = color->b;
+			out += 3;
+		}
+	}
+}
+
+static inline uint32_t shade(const struct iphm_state* state, uint64_t raw_value)
+{
+	const uint32_t shift = 32u - state->bits;
+	return state->shade ? state->shade[raw_value] : (raw_value * 255u + ((1ull << shift) >> 1)) >> shift;
+}
+
+static bool prepare_frames(struct iphm_state* state)
+{
+	struct iphm_render render = { .state = state, .out = state->frame, .row_count = 1u << (state->bits / 2u) };
+	state->engine->render(&render);
+
+	// The first frame is due one interval in, not before anything was read.
+	clock_gettime(CLOCK_MONOTONIC, &state->frame_deadline);
+	double deadline = state->frame_deadline.tv_sec + state->frame_deadline.tv_nsec / 1e9 + state->frame_seconds;
+	state->frame_deadline.tv_sec = deadline;
+	state->frame_deadline.tv_nsec = (deadline - state->frame_deadline.tv_sec) * 1e9;
+	return true;
+}
+
+// Sleeps on stdin, emitting a frame whenever the deadline passes first.
+static bool wait_for_input(struct iphm_state* state)
+{
+	for (;;)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		double remaining = (state->frame_deadline.tv_sec - now.tv_sec) + (state->frame_deadline.tv_nsec - now.tv_nsec) / 1e9;
+		if (remaining <= 0.0)
+		{
+			if (!emit_frame(state))
+				return false;
+			continue;
+		}
+
+		struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+		int timeout = remaining * 1000.0 + 1.0;
+		if (poll(&pfd, 1, timeout) > 0)
+			return true;
+	}
+}
+
+static bool emit_frame(struct iphm_state* state)
+{
+	if (state->dirty_all)
+	{
+		struct iphm_render render = { .state = state, .out = state->frame, .row_count = 1u << (state->bits / 2u) };
+		state->engine->render(&render);
+		memset(state->dirty_bits, 0, ((1UL << state->bits) + 63u) / 64u * sizeof(uint64_t));
+	}
+	else
+	{
+		uint32_t width = 1u << ((state->bits / 2u) + (state->bits & 1u));
+
+		for (size_t i = 0u; i < state->dirty_count; ++i)
+		{
+			uintptr_t index = state->dirty_list[i];
+			state->dirty_bits[index / 64u] &= ~(1ull << (index % 64u));
+
+			uint32_t raw_value;
+			state->engine->widen(state, &raw_value, index, 1u);
+
+			size_t pixel = (size_t)compact_bits(index >> 1) * width + compact_bits(index);
+			const struct rgbx* color = state->palette + shade(state, raw_value);
+			uint8_t* out = state->frame + pixel * 3u;
+			out[0] = color->r;
+			out[1] = color->g;
+			out[2] = color->b;
+		}
+	}
+
+	state->dirty_count = 0u;
+	state->dirty_all = false;
+
+	if (state->frame_seconds > 0.0)
+	{
+		double deadline = state->frame_deadline.tv_sec + state->frame_deadline.tv_nsec / 1e9 + state->frame_seconds;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (deadline < now.tv_sec + now.tv_nsec / 1e9)
+			deadline = now.tv_sec + now.tv_nsec / 1e9 + state->frame_seconds;
+
+		state->frame_deadline.tv_sec = deadline;
+		state->frame_deadline.tv_nsec = (deadline - state->frame_deadline.tv_sec) * 1e9;
+	}
+
+	if (!state->frame_path)
+		return write_frame(state, stdout) && !fflush(stdout);
+
+	// Replace the file atomically so viewers never see a partial frame.
+	size_t path_size = strlen(state->frame_path) + 8u;
+	char* path = malloc(path_size);
+	if (!path)
+	{
+		perror("malloc");
+		return false;
+	}
+
+	snprintf(path, path_size, "%s.XXXXXX", state->frame_path);
+	int fd = mkstemp(path);
+	FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+	if (!file)
+	{
+		perror(path);
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(path);
+		}
+		free(path);
+		return false;
+	}
+
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	bool result = write_frame(state, file);
+	result = !fclose(file) && result;
+	result = result && !rename(path, state->frame_path);
+
+	if (!result)
+	{
+		perror(state->frame_path);
+		unlink(path);
+	}
+
+	free(path);
+	return result;
+}
+
+static bool write_frame(struct iphm_state* state, FILE* file)
+{
+	uint32_t width = 1u << ((state->bits / 2u) + (state->bits & 1u));
+	uint32_t height = 1u << (state->bits / 2u);
+
+	fprintf(file, "P6\n%u %u 255\n", width, height);
+	return fwrite(state->frame, 1u, state->frame_size, file) == state->frame_size;
+}
+
+static inline __attribute((always_inline)) void widen_buckets(const struct iphm_state* state, uint32_t* out, uintptr_t first, size_t count, size_t value_size)
+{
+	if (!value_size)
+	{
+		count_tile(state, out, first, count);
+		return;
+	}
+
+	for (size_t i = 0u; i < count; ++i)
+		out[i] = bucket_get(state->bucket, first + i, value_size);
+}
+
+// Without buckets, each tile is counted from the bitmap or the merged intervals, whichever the addresses ended up in.
+static void count_tile(const struct iphm_state* state, uint32_t* out, uintptr_t first, size_t count)
+{
+	const uint32_t bucket_shift = 32u - state->bits;
+	const uint64_t start = (uint64_t)first << bucket_shift;
+	const uint64_t end = (uint64_t)(first + count) << bucket_shift;
+
+	memset(out, 0, count * sizeof(uint32_t));
+
+	// A tile always covers whole bitmap words.
+	if (state->seen)
+	{
+		uint32_t bucket_width = bucket_shift < 6u ? 1u << bucket_shift : 64u;
+		uint64_t bucket_mask = bucket_width == 64u ? ~0ull : (1ull << bucket_width) - 1u;
+
+		for (uint64_t i = start / 64u; i < end / 64u; ++i)
+		{
+			uint64_t word = state->seen[i];
+			for (uint32_t j = 0u; word && j < 64u; j += bucket_width)
+				out[((i * 64u + j) >> bucket_shift) - first] += __builtin_popcountll((word >> j) & bucket_mask);
+		}
+
+		return;
+	}
+
+	const struct iphm_worker* worker = state->workers;
+	size_t low = 0u, high = worker->range_count;
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2u;
+		if ((uint64_t)worker->ranges[middle].last < start)
+			low = middle + 1u;
+		else
+			high = middle;
+	}
+
+	for (size_t i = low; i < worker->range_count && worker->ranges[i].first < end; ++i)
+	{
+		uint64_t position = worker->ranges[i].first > start ? worker->ranges[i].first : start;
+		uint64_t range_end = (uint64_t)worker->ranges[i].last + 1u < end ? (uint64_t)worker->ranges[i].last + 1u : end;
+
+		while (position < range_end)
+		{
+			uintptr_t bucket_index = position >> bucket_shift;
+			uint64_t bucket_end = (uint64_t)(bucket_index + 1u) << bucket_shift;
+			if (bucket_end > range_end)
+				bucket_end = range_end;
+
+			out[bucket_index - first] += bucket_end - position;
+			position = bucket_end;
+		}
+	}
+}
+
+// Tiles of a level are contiguous runs of bucket indices, so the pyramid is walked depth-first one tile per level at a time.
+static bool render_tiles(struct iphm_state* state)
+{
+	uint32_t top = state->tile_level ? state->tile_level : 2u - (state->bits & 1u);
+	if (top > state->bits || (state->bits - top) & 1u)
+	{
+		fprintf(stderr, "-z: level %u is not reachable from /%u in steps of 2\n", top, state->bits);
+		return false;
+	}
+
+	for (uint32_t level = top; level <= state->bits; level += 2u)
+	{
+		size_t tile_pixels = level < TILE_BITS * 2u ? 1u << level : TILE_PIXELS;
+		state->tile_sums[level] = malloc(tile_pixels * sizeof(uint32_t));
+		if (!state->tile_sums[level])
+		{
+			perror("malloc");
+			return false;
+		}
+	}
+
+	state->tile_out = malloc(TILE_PIXELS * 3u);
+	if (!state->tile_out)
+	{
+		perror("malloc");
+		return false;
+	}
+
+	uint32_t tiles_x = top < TILE_BITS * 2u ? 1u : 1u << ((top + 1u) / 2u - TILE_BITS);
+	uint32_t tiles_y = top < TILE_BITS * 2u ? 1u : 1u << (top / 2u - TILE_BITS);
+	size_t tile_pixels = top < TILE_BITS * 2u ? 1u << top : TILE_PIXELS;
+
+	uint32_t first_x = 0u, first_y = 0u, last_x = tiles_x - 1u, last_y = tiles_y - 1u;
+	if (state->tile_window_given)
+	{
+		first_x = state->tile_window[0];
+		first_y = state->tile_window[1];
+		last_x = state->tile_window[2] < last_x ? state->tile_window[2] : last_x;
+		last_y = state->tile_window[3] < last_y ? state->tile_window[3] : last_y;
+	}
+
+	for (uint32_t ty = first_y; ty <= last_y; ++ty)
+	{
+		for (uint32_t tx = first_x; tx <= last_x; ++tx)
+		{
+			uintptr_t tile = (uintptr_t)state->morton[tx & 255u] | (uintptr_t)state->morton[ty & 255u] << 1;
+			uintptr_t first = tile * tile_pixels;
+
+			if (!sum_tile(state, top, first, state->tile_sums[top]) ||
+				!write_tile(state, top, first, state->tile_sums[top]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool sum_tile(struct iphm_state* state, uint32_t level, uintptr_t first, uint32_t* out)
+{
+	size_t count = level < TILE_BITS * 2u ? 1u << level : TILE_PIXELS;
+
+	if (level == state->bits)
+	{
+		state->engine->widen(state, out, first, count);
+		return true;
+	}
+
+	// Each bucket is the sum of four buckets two levels down, which cover one or more whole tiles there.
+	uint32_t child = level + 2u;
+	size_t child_pixels = child < TILE_BITS * 2u ? 1u << child : TILE_PIXELS;
+	uint32_t* sums = state->tile_sums[child];
+
+	for (size_t offset = 0u; offset < count * 4u; offset += child_pixels)
+	{
+		uintptr_t child_first = first * 4u + offset;
+		if (!sum_tile(state, child, child_first, sums))
+			return false;
+
+		if (!state->tile_level && !write_tile(state, child, child_first, sums))
+			return false;
+
+		uint32_t* target = out + offset / 4u;
+		for (size_t i = 0u; i < child_pixels / 4u; ++i)
+			target[i] = sums[i * 4u] + sums[i * 4u + 1u] + sums[i * 4u + 2u] + sums[i * 4u + 3u];
+	}
+
+	return true;
+}
+
+static bool write_tile(struct iphm_state* state, uint32_t level, uintptr_t first, const uint32_t* sums)
+{
+	uint32_t width_bits = level < TILE_BITS * 2u ? (level + 1u) / 2u : TILE_BITS;
+	uint32_t height_bits = level < TILE_BITS * 2u ? level / 2u : TILE_BITS;
+	uint32_t width = 1u << width_bits;
+	uint32_t height = 1u << height_bits;
+
+	uintptr_t tile = first >> (width_bits + height_bits);
+	uint32_t tx = compact_bits(tile);
+	uint32_t ty = compact_bits(tile >> 1);
+
+	const uint16_t* morton = state->morton;
+	const uint32_t shift = 32u - level;
+	uint8_t* out = state->tile_out;
+
+	for (uint32_t y = 0u; y < height; ++y)
+	{
+		uint32_t y_index = (uint32_t)morton[y] << 1;
+
+		for (uint32_t x = 0u; x < width; ++x)
+		{
+			uint64_t raw_value = sums[y_index | morton[x]];
+			uint32_t value = (raw_value * 255u + ((1ull << shift) >> 1)) >> shift;
+
+			const struct rgbx* color = state->palette + value;
+			out[0] = color->r;
+			out[1] = color->g;
+			out[2] = color->b;
+			out += 3;
+		}
+	}
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%u-%u-%u.ppm", state->tile_path, level, tx, ty);
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+	{
+		perror(path);
+		return false;
+	}
+
+	fprintf(file, "P6\n%u %u 255\n", width, height);
+	fwrite(state->tile_out, 3u, (size_t)width * height, file);
+
+	if (fclose(file))
+	{
+		perror(path);
+		return false;
+	}
+
+	return true;
+}
+
+static uint32_t compact_bits(uint32_t value)
+{
+	value &= 0x55555555u;
+	value = (value | (value >> 1)) & 0x33333333u;
+	value = (value | (value >> 2)) & 0x0F0F0F0Fu;
+	value = (value | (value >> 4)) & 0x00FF00FFu;
+	value = (value | (value >> 8)) & 0x0000FFFFu;
+	return value;
+}
+
+static void cleanup(struct iphm_state* state)
+{
+	if (state->chunks)
+	{
+		pthread_mutex_lock(&state->lock);
+		state->input_done = true;
+		pthread_cond_broadcast(&state->filled);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	if (state->workers)
+	{
+		for (uint32_t i = 0u; i < state->jobs; ++i)
+		{
+			struct iphm_worker* worker = state->workers + i;
+
+			if (worker->started)
+				pthread_join(worker->thread, NULL);
+
+			if (i && worker->bucket && worker->bucket != MAP_FAILED)
+				munmap(worker->bucket, state->bucket_size);
+
+			free(worker->ranges);
+
+			if (state->jobs == 1u)
+				free(worker->input);
+		}
+
+		free(state->workers);
+	}
+
+	if (state->chunks)
+	{
+		for (size_t i = 0u; i < state->chunk_count; ++i)
+			free(state->chunks[i].data);
+
+		free(state->chunks);
+	}
+
+	free(state->shade);
+	free(state->tile_out);
+	free(state->frame);
+	free(state->dirty_bits);
+	free(state->dirty_list);
+
+	for (uint32_t i = 0u; i <= 32u; ++i)
+		free(state->tile_sums[i]);
+
+	if (state->files)
+	{
+		for (size_t i = 0u; i < state->file_count; ++i)
+		{
+			struct iphm_file* file = state->files + i;
+
+			if (file->map)
+				munmap(file->map, file->size);
+
+			if (file->fd >= 0)
+				close(file->fd);
+		}
+
+		free(state->files);
+	}
+
 	if (state->seen && state->seen != MAP_FAILED)
 		munmap(state->seen, SEEN_BYTESIZE);
 
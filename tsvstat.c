@@ -1,90 +1,2124 @@
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <time.h>
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ftw.h>
+#include <string.h>
 
-static int scan(const char*);
-static int scan_cb(const char*, const struct stat*, int, struct FTW*);
-static int try_get_extent_count(const char*, off_t);
+struct tsvstat_dir
+{
+	struct tsvstat_dir* parent;
+	int fd;
+	unsigned int refs;
+	unsigned int retries;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t parent_dev;
+	uint64_t parent_ino;
+	size_t name_offset;
+	size_t length;
+	char path[];
+};
+
+struct tsvstat_deque
+{
+	pthread_mutex_t lock;
+	struct tsvstat_dir** items;
+	size_t head;
+	size_t count;
+	size_t capacity;
+};
+
+enum slot_op
+{
+	SLOT_OPEN,
+	SLOT_STAT,
+	SLOT_CLOSE,
+	SLOT_IDLE,
+};
+
+struct tsvstat_slot
+{
+	const struct dirent64* entry;
+	int fd;
+	enum slot_op op;
+	bool busy;
+	struct statx stx;
+};
+
+struct tsvstat_ring
+{
+	int fd;
+	void* sq_map;
+	size_t sq_map_size;
+	void* cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned int tail;
+	unsigned int queued;
+	struct tsvstat_slot* slots;
+	uint32_t* free_slots;
+	uint32_t free_count;
+	uint32_t* retry_slots;
+	uint32_t retry_count;
+	uint32_t open_count;
+	uint32_t open_budget;
+	uint32_t open_limit;
+	bool failed;
+	struct io_uring_sqe scratch;
+};
+
+struct tsvstat_snapshot_header
+{
+	char magic[8];
+	uint64_t dir_count;
+	uint64_t dirs;
+	uint64_t size;
+};
+
+// One per directory, sorted by (dev, ino); the data holds the name, then the entries as they were last seen.
+struct tsvstat_snapshot_dir
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t parent_dev;
+	uint64_t parent_ino;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint64_t data;
+	uint64_t size;
+	uint32_t name_length;
+	uint32_t entry_count;
+};
+
+// Entries are stored as two lengths followed by the bytes; subdirectories have no record prefix.
+struct tsvstat_entry
+{
+	const char* prefix;
+	uint32_t prefix_length;
+	const char* name;
+	uint32_t name_length;
+};
+
+struct tsvstat_record
+{
+	const char* line;
+	size_t length;
+	const char* name;
+	size_t name_length;
+};
+
+struct tsvstat_worker
+{
+	struct tsvstat_state* state;
+	pthread_t thread;
+	bool started;
+	struct tsvstat_deque deque;
+	uint32_t victim;
+	char* dirents;
+	struct tsvstat_ring ring;
+	char* path;
+	size_t path_capacity;
+	char* out;
+	size_t out_size;
+	size_t out_capacity;
+	size_t* lines;
+	size_t line_count;
+	size_t line_capacity;
+	struct tsvstat_snapshot_dir* dirs;
+	size_t dir_count;
+	size_t dir_capacity;
+	const struct tsvstat_snapshot_dir* old_dir;
+	char* data;
+	size_t data_size;
+	size_t data_capacity;
+	struct tsvstat_entry* entries;
+	size_t entry_capacity;
+	const struct tsvstat_snapshot_dir** chain;
+	size_t chain_capacity;
+	char* old_path;
+	size_t old_path_capacity;
+};
+
+struct tsvstat_state
+{
+	uint32_t jobs;
+	bool sorted;
+	bool synchronous;
+	bool delta;
+	bool indexing;
+	const char* snapshot_path;
+	const char* save_path;
+	char* save_temp;
+	int save_fd;
+	bool save_failed;
+	void* snapshot;
+	size_t snapshot_size;
+	const struct tsvstat_snapshot_dir* snapshot_dirs;
+	size_t snapshot_dir_count;
+	uint8_t* visited;
+	uint64_t data_size;
+	struct tsvstat_worker* workers;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	pthread_mutex_t output;
+	uint32_t idle_count;
+	size_t queued;
+	size_t pending;
+};
+
+#define MAX_JOBS 256
+#define DIRENT_BUFFER_SIZE 0x10000
+#define OUTPUT_BUFFER_SIZE 0x400000
+#define RECORD_MAX_LENGTH 0x100
+#define RING_ENTRIES 256
+#define DIR_OPEN_RETRIES 100
+#define SNAPSHOT_MAGIC "TSVSNP01"
+#define SNAPSHOT_HEADER_SIZE 0x40
+#define FILE_OPEN_FLAGS (O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_NOCTTY|O_CLOEXEC)
+
+static bool parse_arguments(struct tsvstat_state*, int, char**);
+static bool prepare(struct tsvstat_state*);
+static bool open_snapshot(struct tsvstat_state*);
+static bool create_snapshot(struct tsvstat_state*);
+static bool save_snapshot(struct tsvstat_state*);
+static int compare_snapshot_dirs(const void*, const void*);
+static const struct tsvstat_snapshot_dir* find_snapshot_dir(const struct tsvstat_state*, uint64_t, uint64_t);
+static bool begin_dir(struct tsvstat_worker*, const struct tsvstat_dir*, const struct stat*);
+static void replay_dir(struct tsvstat_worker*, struct tsvstat_dir*);
+static void end_dir(struct tsvstat_worker*, const struct tsvstat_dir*, bool);
+static bool add_entry(struct tsvstat_worker*, const char*, size_t, const char*, size_t);
+static bool reserve_data(struct tsvstat_worker*, size_t);
+static size_t read_entries(struct tsvstat_worker*, size_t, const char*, const char*);
+static const char* get_old_path(struct tsvstat_worker*, const struct tsvstat_snapshot_dir*, size_t*);
+static void emit_changes(struct tsvstat_worker*, const struct tsvstat_dir*, const struct tsvstat_snapshot_dir*);
+static void emit_removed(struct tsvstat_worker*, const struct tsvstat_snapshot_dir*);
+static int compare_entries(const void*, const void*);
+static int scan(struct tsvstat_state*, const char*);
+static bool walk(struct tsvstat_state*);
+static void* walk_thread(void*);
+static void walk_worker(struct tsvstat_worker*);
+static void scan_directory(struct tsvstat_worker*, struct tsvstat_dir*);
+static void scan_entry(struct tsvstat_worker*, struct tsvstat_dir*, const struct dirent64*);
+static int record_entry(struct tsvstat_worker*, struct tsvstat_dir*, const struct dirent64*, const char*, const struct stat*, int);
+static bool setup_ring(struct tsvstat_ring*);
+static void close_ring(struct tsvstat_ring*);
+static ssize_t scan_batch(struct tsvstat_worker*, struct tsvstat_dir*, ssize_t);
+static uint32_t reap_ring(struct tsvstat_worker*, struct tsvstat_dir*);
+static void drain_ring(struct tsvstat_worker*, struct tsvstat_dir*);
+static struct io_uring_sqe* queue_op(struct tsvstat_ring*, struct tsvstat_slot*, enum slot_op, int);
+static void start_slot(struct tsvstat_worker*, struct tsvstat_dir*, struct tsvstat_slot*, const struct dirent64*);
+static void open_slot(struct tsvstat_ring*, struct tsvstat_dir*, struct tsvstat_slot*);
+static void complete_slot(struct tsvstat_worker*, struct tsvstat_dir*, struct tsvstat_slot*, int);
+static int run_slot(const struct tsvstat_dir*, struct tsvstat_slot*);
+static void free_slot(struct tsvstat_ring*, struct tsvstat_slot*);
+static void queue_stat(struct tsvstat_ring*, struct tsvstat_slot*, int, const char*, int);
+static bool push_dir(struct tsvstat_worker*, struct tsvstat_dir*, const char*, size_t);
+static bool queue_dir(struct tsvstat_worker*, struct tsvstat_dir*, bool);
+static void detach_dirs(struct tsvstat_state*);
+static struct tsvstat_dir* next_dir(struct tsvstat_worker*);
+static struct tsvstat_dir* steal_dir(struct tsvstat_worker*);
+static void release_dir(struct tsvstat_dir*);
+static const char* join_path(struct tsvstat_worker*, const struct tsvstat_dir*, const char*, size_t);
+static bool emit_record(struct tsvstat_worker*, const char*, const char*, const struct stat*, int);
+static bool emit_line(struct tsvstat_worker*, char, const char*, size_t, const char*, size_t, const char*, size_t);
+static char* reserve_output(struct tsvstat_worker*, size_t);
+static char* format_record(char*, const struct stat*, int);
+static inline char* format_signed(char*, long int);
+static inline char* format_unsigned(char*, unsigned long int);
+static inline char* format_mode(char*, unsigned int);
+static void flush_output(struct tsvstat_worker*);
+static void write_output(struct tsvstat_state*, const char*, size_t);
+static void write_sorted(struct tsvstat_state*);
+static int compare_records(const void*, const void*);
+static int try_get_extent_count(int, const struct stat*);
+static void cleanup(struct tsvstat_state*);
 
 int main(int argc, char** argv)
 {
+	__attribute((cleanup(cleanup)))
+	struct tsvstat_state state = {};
+
+	if (!parse_arguments(&state, argc, argv))
+		return EXIT_FAILURE;
+
+	if (state.snapshot_path && !open_snapshot(&state))
+		return EXIT_FAILURE;
+
+	if (state.save_path && !create_snapshot(&state))
+		return EXIT_FAILURE;
+
+	if (!prepare(&state))
+		return EXIT_FAILURE;
+
 	int result = EXIT_SUCCESS;
 
+	fputs(state.delta ? "CHANGE\t" : "", stdout);
 	puts("DEVICE\tINODE\tMODE\tLINKS\tUID\tGID\tSIZE\tATIME\tMTIME\tCTIME\tEXTENTS\tNAME");
+	fflush(stdout);
 
-	if (argc > 1)
+	// Non-directory arguments are kept in the snapshot as the entries of a pseudo directory with an empty path.
+	struct tsvstat_dir top = { .fd = AT_FDCWD };
+	if (state.indexing && !begin_dir(state.workers, &top, &(struct stat){}))
+		return EXIT_FAILURE;
+
+	if (optind < argc)
 	{
-		for (int i = 1; i < argc; ++i)
+		for (int i = optind; i < argc; ++i)
 		{
-			if (scan(argv[i]) != EXIT_SUCCESS)
+			if (scan(&state, argv[i]) != EXIT_SUCCESS)
 				result = EXIT_FAILURE;
 		}
 	}
 	else
 	{
-		result = scan(".");
+		result = scan(&state, ".");
+	}
+
+	if (state.indexing)
+		end_dir(state.workers, &top, false);
+
+	if (!walk(&state))
+		return EXIT_FAILURE;
+
+	// Whatever the previous snapshot has that this walk never reached is gone.
+	if (state.delta)
+	{
+		for (size_t i = 0u; i < state.snapshot_dir_count; ++i)
+		{
+			if (!state.visited[i])
+				emit_removed(state.workers, state.snapshot_dirs + i);
+		}
+	}
+
+	if (state.sorted)
+		write_sorted(&state);
+	else
+	{
+		for (uint32_t i = 0u; i < state.jobs; ++i)
+			flush_output(state.workers + i);
 	}
 
+	if (state.save_path && !save_snapshot(&state))
+		return EXIT_FAILURE;
+
 	return result;
 }
 
-static int scan(const char* path)
+static bool parse_arguments(struct tsvstat_state* state, int argc, char** argv)
 {
-	if (nftw(path, scan_cb, sysconf(_SC_OPEN_MAX) - 4, FTW_PHYS) == -1)
+	state->jobs = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "di:j:no:s")) != -1)
 	{
-		perror("nftw");
-		return EXIT_FAILURE;
+		char* endptr;
+		unsigned long int value;
+
+		switch (opt)
+		{
+			case 'd':
+				state->delta = true;
+				break;
+			case 'i':
+				state->snapshot_path = optarg;
+				break;
+			case 'j':
+				value = strtoul(optarg, &endptr, 10);
+				if (*endptr || value < 1 || value > MAX_JOBS)
+				{
+					fprintf(stderr, "-j: invalid job count %s\n", optarg);
+					return false;
+				}
+				state->jobs = value;
+				break;
+			case 'n':
+				state->synchronous = true;
+				break;
+			case 'o':
+				state->save_path = optarg;
+				break;
+			case 's':
+				state->sorted = true;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	if (state->delta && !state->snapshot_path)
+	{
+		fprintf(stderr, "-d: needs a previous snapshot from -i\n");
+		return false;
 	}
 
-	return EXIT_SUCCESS;
+	state->indexing = state->snapshot_path || state->save_path;
+	state->save_fd = -1;
+	return true;
 }
 
-static int scan_cb(const char* path, const struct stat* sb, int typeflag, struct FTW* ftwbuf)
+static bool open_snapshot(struct tsvstat_state* state)
 {
-	if (typeflag != FTW_F)
-		return 0;
-
-	printf(
-		"%ld\t%ld\t%04o\t%lu\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%d\t%s\n",
-		sb->st_dev,
-		sb->st_ino,
-		sb->st_mode & ~S_IFMT,
-		sb->st_nlink,
-		sb->st_uid,
-		sb->st_gid,
-		sb->st_size,
-		sb->st_atime,
-		sb->st_mtime,
-		sb->st_ctime,
-		try_get_extent_count(path, sb->st_size),
-		path
-	);
-	return 0;
-}
-
-static int try_get_extent_count(const char* path, off_t size)
-{
-	int fd = open(path, O_RDONLY);
+	int fd = open(state->snapshot_path, O_RDONLY|O_CLOEXEC);
 	if (fd == -1)
 	{
-		perror(path);
-		return -1;
+		// A missing snapshot is an empty one, so the very first incremental run needs nothing special.
+		if (errno == ENOENT)
+			return true;
+
+		perror(state->snapshot_path);
+		return false;
 	}
 
-	struct fiemap fm = { .fm_length = size };
-	if (ioctl(fd, FS_IOC_FIEMAP, &fm) == -1)
+	struct stat sb;
+	if (fstat(fd, &sb) == -1)
 	{
-		perror("ioctl");
+		perror(state->snapshot_path);
 		close(fd);
-		return -1;
+		return false;
+	}
+
+	if (sb.st_size >= SNAPSHOT_HEADER_SIZE)
+	{
+		state->snapshot_size = sb.st_size;
+		state->snapshot = mmap(NULL, state->snapshot_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (state->snapshot == MAP_FAILED)
+		{
+			state->snapshot = NULL;
+			perror(state->snapshot_path);
+			close(fd);
+			return false;
+		}
 	}
 
 	close(fd);
-	return fm.fm_mapped_extents;
+
+	const struct tsvstat_snapshot_header* header = state->snapshot;
+	bool valid = header &&
+		!memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) &&
+		header->size == state->snapshot_size &&
+		header->dirs % sizeof(uint64_t) == 0u &&
+		header->dirs <= state->snapshot_size &&
+		header->dir_count <= (state->snapshot_size - header->dirs) / sizeof(struct tsvstat_snapshot_dir);
+
+	if (valid)
+	{
+		state->snapshot_dirs = (const struct tsvstat_snapshot_dir*)((const char*)state->snapshot + header->dirs);
+		state->snapshot_dir_count = header->dir_count;
+
+		for (size_t i = 0u; valid && i < state->snapshot_dir_count; ++i)
+		{
+			const struct tsvstat_snapshot_dir* dir = state->snapshot_dirs + i;
+			valid = dir->data >= SNAPSHOT_HEADER_SIZE && dir->data <= header->dirs && dir->size <= header->dirs - dir->data && dir->name_length <= dir->size;
+		}
+	}
+
+	if (!valid)
+	{
+		fprintf(stderr, "-i: %s is not a tsvstat snapshot\n", state->snapshot_path);
+		return false;
+	}
+
+	state->visited = calloc(state->snapshot_dir_count + 1u, 1u);
+	return state->visited != NULL;
+}
+
+static bool create_snapshot(struct tsvstat_state* state)
+{
+	size_t path_size = strlen(state->save_path) + 8u;
+	state->save_temp = malloc(path_size);
+	if (!state->save_temp)
+	{
+		perror("malloc");
+		return false;
+	}
+
+	// The directory data is streamed to a file next to the target as the walk goes, then renamed into place.
+	snprintf(state->save_temp, path_size, "%s.XXXXXX", state->save_path);
+	state->save_fd = mkostemp(state->save_temp, O_CLOEXEC);
+	if (state->save_fd == -1)
+	{
+		perror(state->save_temp);
+		free(state->save_temp);
+		state->save_temp = NULL;
+		return false;
+	}
+
+	// mkstemp creates the file 0600; give it the usual permissions.
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(state->save_fd, 0666 & ~mask);
+
+	return true;
+}
+
+static bool save_snapshot(struct tsvstat_state* state)
+{
+	size_t count = 0u;
+	for (uint32_t i = 0u; i < state->jobs; ++i)
+		count += state->workers[i].dir_count;
+
+	struct tsvstat_snapshot_dir* dirs = malloc(count * sizeof(struct tsvstat_snapshot_dir) + 1u);
+	if (!dirs)
+	{
+		perror("malloc");
+		return false;
+	}
+
+	size_t offset = 0u;
+	for (uint32_t i = 0u; i < state->jobs; ++i)
+	{
+		const struct tsvstat_worker* worker = state->workers + i;
+		memcpy(dirs + offset, worker->dirs, worker->dir_count * sizeof(struct tsvstat_snapshot_dir));
+		offset += worker->dir_count;
+	}
+
+	qsort(dirs, count, sizeof(struct tsvstat_snapshot_dir), compare_snapshot_dirs);
+
+	// A directory reached twice, through overlapping arguments, is only kept once.
+	size_t unique = 0u;
+	for (size_t i = 0u; i < count; ++i)
+	{
+		if (!unique || compare_snapshot_dirs(dirs + unique - 1u, dirs + i))
+			dirs[unique++] = dirs[i];
+	}
+
+	struct tsvstat_snapshot_header header = { .dir_count = unique };
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.dirs = (SNAPSHOT_HEADER_SIZE + state->data_size + sizeof(uint64_t) - 1u) & ~(uint64_t)(sizeof(uint64_t) - 1u);
+	header.size = header.dirs + unique * sizeof(struct tsvstat_snapshot_dir);
+
+	bool result = !state->save_failed;
+	result = result && pwrite(state->save_fd, dirs, unique * sizeof(struct tsvstat_snapshot_dir), header.dirs) == (ssize_t)(unique * sizeof(struct tsvstat_snapshot_dir));
+	result = result && !ftruncate(state->save_fd, header.size);
+	result = result && pwrite(state->save_fd, &header, sizeof(header), 0) == sizeof(header);
+	result = !close(state->save_fd) && result;
+	state->save_fd = -1;
+	result = result && !rename(state->save_temp, state->save_path);
+
+	if (!result)
+		perror(state->save_path);
+	else
+	{
+		free(state->save_temp);
+		state->save_temp = NULL;
+	}
+
+	free(dirs);
+	return result;
+}
+
+static int compare_snapshot_dirs(const void* a, const void* b)
+{
+	const struct tsvstat_snapshot_dir* da = a;
+	const struct tsvstat_snapshot_dir* db = b;
+
+	if (da->dev != db->dev)
+		return da->dev < db->dev ? -1 : 1;
+
+	return (da->ino > db->ino) - (da->ino < db->ino);
+}
+
+static const struct tsvstat_snapshot_dir* find_snapshot_dir(const struct tsvstat_state* state, uint64_t dev, uint64_t ino)
+{
+	const struct tsvstat_snapshot_dir key = { .dev = dev, .ino = ino };
+	return bsearch(&key, state->snapshot_dirs, state->snapshot_dir_count, sizeof(struct tsvstat_snapshot_dir), compare_snapshot_dirs);
+}
+
+static bool begin_dir(struct tsvstat_worker* worker, const struct tsvstat_dir* dir, const struct stat* sb)
+{
+	struct tsvstat_state* state = worker->state;
+
+	if (worker->dir_count == worker->dir_capacity)
+	{
+		size_t capacity = worker->dir_capacity ? worker->dir_capacity * 2u : 0x100u;
+		struct tsvstat_snapshot_dir* dirs = realloc(worker->dirs, capacity * sizeof(struct tsvstat_snapshot_dir));
+		if (!dirs)
+		{
+			perror("realloc");
+			return false;
+		}
+
+		worker->dirs = dirs;
+		worker->dir_capacity = capacity;
+	}
+
+	// The entry is only counted once the directory is done; until then it collects into the data buffer.
+	struct tsvstat_snapshot_dir* entry = worker->dirs + worker->dir_count;
+	*entry = (struct tsvstat_snapshot_dir){
+		.dev = sb->st_dev,
+		.ino = sb->st_ino,
+		.parent_dev = dir->parent_dev,
+		.parent_ino = dir->parent_ino,
+		.mtime = sb->st_mtim.tv_sec,
+		.ctime = sb->st_ctim.tv_sec,
+		.mtime_nsec = sb->st_mtim.tv_nsec,
+		.ctime_nsec = sb->st_ctim.tv_nsec,
+		.name_length = dir->length - dir->name_offset,
+	};
+
+	worker->data_size = 0u;
+	if (!reserve_data(worker, entry->name_length))
+		return false;
+
+	memcpy(worker->data, dir->path + dir->name_offset, entry->name_length);
+	worker->data_size = entry->name_length;
+
+	worker->old_dir = find_snapshot_dir(state, entry->dev, entry->ino);
+	if (worker->old_dir)
+		__atomic_store_n(state->visited + (worker->old_dir - state->snapshot_dirs), 1u, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+static void replay_dir(struct tsvstat_worker* worker, struct tsvstat_dir* dir)
+{
+	struct tsvstat_state* state = worker->state;
+	const struct tsvstat_snapshot_dir* old = worker->old_dir;
+	const char* data = (const char*)state->snapshot + old->data;
+
+	size_t count = read_entries(worker, 0u, data + old->name_length, data + old->size);
+	for (size_t i = 0u; i < count; ++i)
+	{
+		const struct tsvstat_entry* entry = worker->entries + i;
+		if (!entry->prefix_length)
+			push_dir(worker, dir, entry->name, entry->name_length);
+		else if (add_entry(worker, entry->prefix, entry->prefix_length, entry->name, entry->name_length) && !state->delta)
+			emit_line(worker, 0, entry->prefix, entry->prefix_length, dir->path, dir->length, entry->name, entry->name_length);
+	}
+}
+
+static void end_dir(struct tsvstat_worker* worker, const struct tsvstat_dir* dir, bool replayed)
+{
+	struct tsvstat_state* state = worker->state;
+	struct tsvstat_snapshot_dir* entry = worker->dirs + worker->dir_count;
+
+	entry->size = worker->data_size;
+	entry->data = SNAPSHOT_HEADER_SIZE + __atomic_fetch_add(&state->data_size, entry->size, __ATOMIC_RELAXED);
+
+	if (state->save_fd >= 0 && !state->save_failed && pwrite(state->save_fd, worker->data, entry->size, entry->data) != (ssize_t)entry->size)
+	{
+		perror(state->save_temp);
+		state->save_failed = true;
+	}
+
+	++worker->dir_count;
+
+	if (!state->delta)
+		return;
+
+	// A directory that moved is reported as removed from its old path and added under the new one.
+	const struct tsvstat_snapshot_dir* old = worker->old_dir;
+	if (old)
+	{
+		size_t length;
+		const char* path = get_old_path(worker, old, &length);
+		if (path && length == dir->length && !memcmp(path, dir->path, length))
+		{
+			if (replayed)
+				return;
+		}
+		else
+		{
+			emit_removed(worker, old);
+			old = NULL;
+		}
+	}
+
+	emit_changes(worker, dir, old);
+}
+
+static bool add_entry(struct tsvstat_worker* worker, const char* prefix, size_t prefix_length, const char* name, size_t name_length)
+{
+	size_t size = 2u * sizeof(uint32_t) + prefix_length + name_length;
+	if (!reserve_data(worker, size))
+		return false;
+
+	uint32_t lengths[2] = { prefix_length, name_length };
+	char* out = worker->data + worker->data_size;
+	memcpy(out, lengths, sizeof(lengths));
+	memcpy(out + sizeof(lengths), prefix, prefix_length);
+	memcpy(out + sizeof(lengths) + prefix_length, name, name_length);
+
+	worker->data_size += size;
+	++worker->dirs[worker->dir_count].entry_count;
+	return true;
+}
+
+static bool reserve_data(struct tsvstat_worker* worker, size_t size)
+{
+	if (worker->data_capacity - worker->data_size >= size)
+		return true;
+
+	size_t capacity = worker->data_capacity ? worker->data_capacity * 2u : 0x10000u;
+	while (capacity - worker->data_size < size)
+		capacity *= 2u;
+
+	char* data = realloc(worker->data, capacity);
+	if (!data)
+	{
+		perror("realloc");
+		return false;
+	}
+
+	worker->data = data;
+	worker->data_capacity = capacity;
+	return true;
+}
+
+static size_t read_entries(struct tsvstat_worker* worker, size_t count, const char* data, const char* end)
+{
+	// Parses entries into the scratch array after the first count; a truncated entry ends the list.
+	while ((size_t)(end - data) >= 2u * sizeof(uint32_t))
+	{
+		uint32_t lengths[2];
+		memcpy(lengths, data, sizeof(lengths));
+		data += sizeof(lengths);
+
+		if ((size_t)(end - data) < (size_t)lengths[0] + lengths[1])
+			break;
+
+		if (count == worker->entry_capacity)
+		{
+			size_t capacity = worker->entry_capacity ? worker->entry_capacity * 2u : 0x400u;
+			struct tsvstat_entry* entries = realloc(worker->entries, capacity * sizeof(struct tsvstat_entry));
+			if (!entries)
+			{
+				perror("realloc");
+				break;
+			}
+
+			worker->entries = entries;
+			worker->entry_capacity = capacity;
+		}
+
+		worker->entries[count++] = (struct tsvstat_entry){ data, lengths[0], data + lengths[0], lengths[1] };
+		data += lengths[0] + lengths[1];
+	}
+
+	return count;
+}
+
+static const char* get_old_path(struct tsvstat_worker* worker, const struct tsvstat_snapshot_dir* old, size_t* length)
+{
+	struct tsvstat_state* state = worker->state;
+
+	// Walk up to the pseudo directory of the arguments, then join the names back down.
+	size_t depth = 0u;
+	for (const struct tsvstat_snapshot_dir* dir = old; dir && (dir->dev || dir->ino); dir = find_snapshot_dir(state, dir->parent_dev, dir->parent_ino))
+	{
+		if (depth == state->snapshot_dir_count)
+			return NULL;
+
+		if (depth == worker->chain_capacity)
+		{
+			size_t capacity = worker->chain_capacity ? worker->chain_capacity * 2u : 0x40u;
+			const struct tsvstat_snapshot_dir** chain = realloc(worker->chain, capacity * sizeof(struct tsvstat_snapshot_dir*));
+			if (!chain)
+			{
+				perror("realloc");
+				return NULL;
+			}
+
+			worker->chain = chain;
+			worker->chain_capacity = capacity;
+		}
+
+		worker->chain[depth++] = dir;
+	}
+
+	size_t size = 1u;
+	for (size_t i = 0u; i < depth; ++i)
+		size += worker->chain[i]->name_length + 1u;
+
+	if (size > worker->old_path_capacity)
+	{
+		char* path = realloc(worker->old_path, size);
+		if (!path)
+		{
+			perror("realloc");
+			return NULL;
+		}
+
+		worker->old_path = path;
+		worker->old_path_capacity = size;
+	}
+
+	*length = 0u;
+	while (depth--)
+	{
+		const struct tsvstat_snapshot_dir* dir = worker->chain[depth];
+		if (*length && worker->old_path[*length - 1u] != '/')
+			worker->old_path[(*length)++] = '/';
+
+		memcpy(worker->old_path + *length, (const char*)state->snapshot + dir->data, dir->name_length);
+		*length += dir->name_length;
+	}
+
+	return worker->old_path;
+}
+
+static void emit_changes(struct tsvstat_worker* worker, const struct tsvstat_dir* dir, const struct tsvstat_snapshot_dir* old)
+{
+	struct tsvstat_state* state = worker->state;
+	const struct tsvstat_snapshot_dir* entry = worker->dirs + worker->dir_count - 1u;
+
+	size_t old_count = 0u;
+	if (old)
+	{
+		const char* data = (const char*)state->snapshot + old->data;
+		old_count = read_entries(worker, 0u, data + old->name_length, data + old->size);
+	}
+
+	size_t count = read_entries(worker, old_count, worker->data + entry->name_length, worker->data + entry->size);
+
+	struct tsvstat_entry* a = worker->entries;
+	struct tsvstat_entry* b = worker->entries + old_count;
+	size_t a_count = old_count;
+	size_t b_count = count - old_count;
+
+	qsort(a, a_count, sizeof(struct tsvstat_entry), compare_entries);
+	qsort(b, b_count, sizeof(struct tsvstat_entry), compare_entries);
+
+	// Both lists are sorted by name, so one merge pass finds what was added, removed or changed.
+	while (a_count || b_count)
+	{
+		int order = !a_count ? 1 : !b_count ? -1 : compare_entries(a, b);
+
+		if (order < 0)
+		{
+			if (a->prefix_length)
+				emit_line(worker, 'R', a->prefix, a->prefix_length, dir->path, dir->length, a->name, a->name_length);
+			++a, --a_count;
+		}
+		else if (order > 0)
+		{
+			if (b->prefix_length)
+				emit_line(worker, 'A', b->prefix, b->prefix_length, dir->path, dir->length, b->name, b->name_length);
+			++b, --b_count;
+		}
+		else
+		{
+			if (b->prefix_length && (a->prefix_length != b->prefix_length || memcmp(a->prefix, b->prefix, a->prefix_length)))
+				emit_line(worker, a->prefix_length ? 'M' : 'A', b->prefix, b->prefix_length, dir->path, dir->length, b->name, b->name_length);
+			else if (a->prefix_length && !b->prefix_length)
+				emit_line(worker, 'R', a->prefix, a->prefix_length, dir->path, dir->length, a->name, a->name_length);
+			++a, --a_count;
+			++b, --b_count;
+		}
+	}
+}
+
+static void emit_removed(struct tsvstat_worker* worker, const struct tsvstat_snapshot_dir* old)
+{
+	struct tsvstat_state* state = worker->state;
+	const char* data = (const char*)state->snapshot + old->data;
+
+	size_t count = read_entries(worker, 0u, data + old->name_length, data + old->size);
+
+	size_t length;
+	const char* path = get_old_path(worker, old, &length);
+	if (!path)
+		return;
+
+	for (size_t i = 0u; i < count; ++i)
+	{
+		const struct tsvstat_entry* entry = worker->entries + i;
+		if (entry->prefix_length)
+			emit_line(worker, 'R', entry->prefix, entry->prefix_length, path, length, entry->name, entry->name_length);
+	}
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+	const struct tsvstat_entry* ea = a;
+	const struct tsvstat_entry* eb = b;
+
+	int result = memcmp(ea->name, eb->name, ea->name_length < eb->name_length ? ea->name_length : eb->name_length);
+	if (result)
+		return result;
+
+	return (ea->name_length > eb->name_length) - (ea->name_length < eb->name_length);
+}
+
+static bool prepare(struct tsvstat_state* state)
+{
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->idle, NULL);
+	pthread_mutex_init(&state->output, NULL);
+
+	state->workers = calloc(state->jobs, sizeof(struct tsvstat_worker));
+	if (!state->workers)
+		return false;
+
+	// The rings share half of what the fd limit leaves after some headroom; the other half is for directories.
+	uint32_t open_limit = RING_ENTRIES;
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY)
+	{
+		rlim_t share = limit.rlim_cur > 0x40u ? (limit.rlim_cur - 0x40u) / 2u / state->jobs : 0u;
+		open_limit = share > RING_ENTRIES ? RING_ENTRIES : share;
+	}
+
+	for (uint32_t i = 0u; i < state->jobs; ++i)
+	{
+		struct tsvstat_worker* worker = state->workers + i;
+		worker->state = state;
+		worker->victim = i;
+		worker->ring.fd = -1;
+		pthread_mutex_init(&worker->deque.lock, NULL);
+
+		worker->dirents = malloc(DIRENT_BUFFER_SIZE);
+		worker->out_capacity = OUTPUT_BUFFER_SIZE;
+		worker->out = malloc(worker->out_capacity);
+		if (!worker->dirents || !worker->out)
+			return false;
+
+		// Without io_uring, when the kernel lacks the ops, or with too few fds to keep any opens in flight,
+		// the worker quietly stays on plain syscalls.
+		if (!state->synchronous && open_limit && !setup_ring(&worker->ring))
+			close_ring(&worker->ring);
+
+		worker->ring.open_budget = worker->ring.open_limit = open_limit;
+	}
+
+	return true;
+}
+
+static int scan(struct tsvstat_state* state, const char* path)
+{
+	struct stat sb;
+	if (fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	// Same trimming nftw does, so the names come out identical.
+	size_t length = strlen(path);
+	while (length > 1u && path[length - 1u] == '/')
+		--length;
+
+	// Roots all go to the first worker; the others steal from it as soon as they start.
+	struct tsvstat_worker* worker = state->workers;
+
+	if (S_ISDIR(sb.st_mode))
+		return push_dir(worker, NULL, path, length) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	if (S_ISLNK(sb.st_mode))
+		return EXIT_SUCCESS;
+
+	int fd = S_ISREG(sb.st_mode) && sb.st_size ? open(path, FILE_OPEN_FLAGS) : -1;
+	bool result = emit_record(worker, path, path, &sb, try_get_extent_count(fd, &sb));
+
+	if (fd >= 0)
+		close(fd);
+
+	return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool walk(struct tsvstat_state* state)
+{
+	for (uint32_t i = 1u; i < state->jobs; ++i)
+	{
+		struct tsvstat_worker* worker = state->workers + i;
+		if (pthread_create(&worker->thread, NULL, walk_thread, worker))
+		{
+			perror("pthread_create");
+			return false;
+		}
+		worker->started = true;
+	}
+
+	walk_worker(state->workers);
+
+	for (uint32_t i = 1u; i < state->jobs; ++i)
+	{
+		struct tsvstat_worker* worker = state->workers + i;
+		pthread_join(worker->thread, NULL);
+		worker->started = false;
+	}
+
+	return true;
+}
+
+static void* walk_thread(void* arg)
+{
+	walk_worker(arg);
+	return NULL;
+}
+
+static void walk_worker(struct tsvstat_worker* worker)
+{
+	struct tsvstat_state* state = worker->state;
+
+	struct tsvstat_dir* dir;
+	while ((dir = next_dir(worker)))
+	{
+		scan_directory(worker, dir);
+
+		if (!__atomic_sub_fetch(&state->pending, 1u, __ATOMIC_SEQ_CST))
+		{
+			pthread_mutex_lock(&state->lock);
+			pthread_cond_broadcast(&state->idle);
+			pthread_mutex_unlock(&state->lock);
+		}
+	}
+}
+
+static void scan_directory(struct tsvstat_worker* worker, struct tsvstat_dir* dir)
+{
+	if (dir->parent)
+		dir->fd = openat(dir->parent->fd, dir->path + dir->name_offset, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	else
+		dir->fd = open(dir->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+
+	int error = dir->fd == -1 ? errno : 0;
+	release_dir(dir->parent);
+	dir->parent = NULL;
+
+	// Running out of fds is no reason to lose a subtree: queued directories give up their parents' fds,
+	// and this one is opened by full path, or put back on the queue until the other workers have closed some.
+	if (error == EMFILE || error == ENFILE)
+	{
+		detach_dirs(worker->state);
+		dir->fd = open(dir->path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		error = dir->fd == -1 ? errno : 0;
+
+		if ((error == EMFILE || error == ENFILE) && dir->retries < DIR_OPEN_RETRIES)
+		{
+			++dir->retries;
+			nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+			if (queue_dir(worker, dir, true))
+				return;
+		}
+	}
+
+	if (dir->fd == -1)
+	{
+		errno = error;
+		perror(dir->path);
+		release_dir(dir);
+		return;
+	}
+
+	// With a snapshot, a directory whose mtime and ctime are unchanged is replayed from it instead of read.
+	bool replayed = false;
+	if (worker->state->indexing)
+	{
+		struct stat sb;
+		if (fstat(dir->fd, &sb) == -1 || !begin_dir(worker, dir, &sb))
+		{
+			perror(dir->path);
+			release_dir(dir);
+			return;
+		}
+
+		dir->dev = sb.st_dev;
+		dir->ino = sb.st_ino;
+
+		const struct tsvstat_snapshot_dir* old = worker->old_dir;
+		if (old && old->mtime == sb.st_mtim.tv_sec && old->mtime_nsec == sb.st_mtim.tv_nsec && old->ctime == sb.st_ctim.tv_sec && old->ctime_nsec == sb.st_ctim.tv_nsec)
+		{
+			replay_dir(worker, dir);
+			replayed = true;
+		}
+	}
+
+	while (!replayed)
+	{
+		ssize_t size = getdents64(dir->fd, worker->dirents, DIRENT_BUFFER_SIZE);
+		if (size <= 0)
+		{
+			if (size == -1)
+				perror(dir->path);
+			break;
+		}
+
+		ssize_t offset = 0;
+		if (worker->ring.fd >= 0)
+			offset = scan_batch(worker, dir, size);
+
+		while (offset < size)
+		{
+			const struct dirent64* entry = (const struct dirent64*)(worker->dirents + offset);
+			offset += entry->d_reclen;
+
+			const char* name = entry->d_name;
+			if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+				continue;
+
+			scan_entry(worker, dir, entry);
+		}
+	}
+
+	if (worker->state->indexing)
+		end_dir(worker, dir, replayed);
+
+	release_dir(dir);
+}
+
+static void scan_entry(struct tsvstat_worker* worker, struct tsvstat_dir* dir, const struct dirent64* entry)
+{
+	size_t name_length = strlen(entry->d_name);
+
+	// The directory entry type saves a stat on symlinks and subdirectories, which are never printed.
+	if (entry->d_type == DT_LNK)
+		return;
+
+	if (entry->d_type == DT_DIR)
+	{
+		push_dir(worker, dir, entry->d_name, name_length);
+		return;
+	}
+
+	const char* path = join_path(worker, dir, entry->d_name, name_length);
+	if (!path)
+		return;
+
+	// Regular files are opened once and stat'ed through that fd; anything that cannot be opened still gets its stat.
+	struct stat sb;
+	int fd = entry->d_type == DT_REG ? openat(dir->fd, entry->d_name, FILE_OPEN_FLAGS) : -1;
+	if (fd >= 0 && fstat(fd, &sb) == -1)
+	{
+		perror(path);
+		close(fd);
+		return;
+	}
+
+	if (fd == -1 && fstatat(dir->fd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+	{
+		perror(path);
+		return;
+	}
+
+	fd = record_entry(worker, dir, entry, path, &sb, fd);
+	if (fd >= 0)
+		close(fd);
+}
+
+static int record_entry(struct tsvstat_worker* worker, struct tsvstat_dir* dir, const struct dirent64* entry, const char* path, const struct stat* sb, int fd)
+{
+	if (S_ISLNK(sb->st_mode))
+		return fd;
+
+	if (S_ISDIR(sb->st_mode))
+	{
+		push_dir(worker, dir, entry->d_name, strlen(entry->d_name));
+		return fd;
+	}
+
+	// Only regular files are ever opened, since opening a fifo can block and opening a device can have side effects.
+	if (fd == -1 && entry->d_type == DT_UNKNOWN && S_ISREG(sb->st_mode) && sb->st_size)
+		fd = openat(dir->fd, entry->d_name, FILE_OPEN_FLAGS);
+
+	emit_record(worker, entry->d_name, path, sb, try_get_extent_count(fd, sb));
+	return fd;
+}
+
+static bool setup_ring(struct tsvstat_ring* ring)
+{
+	struct io_uring_params params = {};
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd == -1)
+		return false;
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP && ring->sq_map_size < ring->cq_map_size)
+		ring->sq_map_size = ring->cq_map_size;
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		return false;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_map = ring->sq_map;
+	else
+	{
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+			return false;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return false;
+
+	ring->sq_tail = (unsigned int*)((char*)ring->sq_map + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((char*)ring->sq_map + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)((char*)ring->sq_map + params.sq_off.array);
+	ring->cq_head = (unsigned int*)((char*)ring->cq_map + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)((char*)ring->cq_map + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((char*)ring->cq_map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_map + params.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+
+	// STATX, OPENAT and CLOSE all arrived in 5.6; older kernels set the ring up fine but reject them.
+	struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+
+	bool supported = !syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)
+		&& probe->last_op >= IORING_OP_STATX
+		&& probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED
+		&& probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED
+		&& probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED;
+
+	free(probe);
+	if (!supported)
+		return false;
+
+	// Every slot has at most one request outstanding, so neither queue can ever overflow.
+	ring->slots = malloc(RING_ENTRIES * sizeof(struct tsvstat_slot));
+	ring->free_slots = malloc(RING_ENTRIES * sizeof(uint32_t));
+	ring->retry_slots = malloc(RING_ENTRIES * sizeof(uint32_t));
+	if (!ring->slots || !ring->free_slots || !ring->retry_slots)
+		return false;
+
+	for (uint32_t i = 0u; i < RING_ENTRIES; ++i)
+	{
+		ring->slots[i] = (struct tsvstat_slot){ .fd = -1, .op = SLOT_IDLE };
+		ring->free_slots[i] = RING_ENTRIES - 1u - i;
+	}
+	ring->free_count = RING_ENTRIES;
+
+	return true;
+}
+
+static void close_ring(struct tsvstat_ring* ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+
+	if (ring->sq_map && ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map, ring->sq_map_size);
+
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring->slots);
+	free(ring->free_slots);
+	free(ring->retry_slots);
+
+	*ring = (struct tsvstat_ring){ .fd = -1 };
+}
+
+static ssize_t scan_batch(struct tsvstat_worker* worker, struct tsvstat_dir* dir, ssize_t size)
+{
+	struct tsvstat_ring* ring = &worker->ring;
+
+	ssize_t offset = 0;
+	for (;;)
+	{
+		// Keep every free slot busy with the next entries of the buffer, as far as the fd budget allows,
+		// then wait for anything to complete. Opens that ran out of fds go first once there is room again.
+		while (ring->retry_count && ring->open_count < ring->open_budget)
+			open_slot(ring, dir, ring->slots + ring->retry_slots[--ring->retry_count]);
+
+		while (offset < size && ring->free_count)
+		{
+			const struct dirent64* entry = (const struct dirent64*)(worker->dirents + offset);
+			if (entry->d_type == DT_REG && ring->open_count >= ring->open_budget)
+				break;
+
+			offset += entry->d_reclen;
+
+			const char* name = entry->d_name;
+			if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+				continue;
+
+			if (entry->d_type == DT_LNK)
+				continue;
+
+			if (entry->d_type == DT_DIR)
+			{
+				push_dir(worker, dir, name, strlen(name));
+				continue;
+			}
+
+			start_slot(worker, dir, ring->slots + ring->free_slots[--ring->free_count], entry);
+		}
+
+		if (ring->free_count == RING_ENTRIES)
+			return offset;
+
+		__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+		int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted == -1)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+
+			// The rest of the walk goes on without the ring, but only once every slot on it is done.
+			perror("io_uring_enter");
+			drain_ring(worker, dir);
+			close_ring(ring);
+			return offset;
+		}
+
+		ring->queued -= submitted;
+		reap_ring(worker, dir);
+	}
+}
+
+static uint32_t reap_ring(struct tsvstat_worker* worker, struct tsvstat_dir* dir)
+{
+	struct tsvstat_ring* ring = &worker->ring;
+
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	uint32_t count = tail - head;
+
+	for (; head != tail; ++head)
+	{
+		const struct io_uring_cqe* cqe = ring->cqes + (head & *ring->cq_mask);
+		struct tsvstat_slot* slot = ring->slots + cqe->user_data;
+		slot->busy = false;
+		complete_slot(worker, dir, slot, cqe->res);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+static void drain_ring(struct tsvstat_worker* worker, struct tsvstat_dir* dir)
+{
+	struct tsvstat_ring* ring = &worker->ring;
+	ring->failed = true;
+
+	// A failed enter submitted nothing, so whatever is still queued never reached the kernel.
+	for (; ring->queued; --ring->queued)
+		ring->slots[ring->sqes[ring->sq_array[--ring->tail & *ring->sq_mask]].user_data].busy = false;
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+	uint32_t busy = 0u;
+	for (uint32_t i = 0u; i < RING_ENTRIES; ++i)
+		busy += ring->slots[i].busy;
+
+	// What is in flight is waited for, so that no result is lost and every fd it opens gets closed.
+	while (busy)
+	{
+		if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+		{
+			perror("io_uring_enter");
+			break;
+		}
+
+		busy -= reap_ring(worker, dir);
+	}
+
+	// Everything else is carried through to the end with plain syscalls.
+	ring->retry_count = 0u;
+	for (uint32_t i = 0u; i < RING_ENTRIES; ++i)
+	{
+		struct tsvstat_slot* slot = ring->slots + i;
+		while (!slot->busy && slot->op != SLOT_IDLE)
+			complete_slot(worker, dir, slot, run_slot(dir, slot));
+	}
+}
+
+static struct io_uring_sqe* queue_op(struct tsvstat_ring* ring, struct tsvstat_slot* slot, enum slot_op op, int fd)
+{
+	// Once the ring has failed, the op is only recorded, for run_slot to carry out.
+	slot->op = op;
+	if (ring->failed)
+		return &ring->scratch;
+
+	slot->busy = true;
+	unsigned int index = ring->tail++ & *ring->sq_mask;
+	++ring->queued;
+
+	struct io_uring_sqe* sqe = ring->sqes + index;
+	*sqe = (struct io_uring_sqe){ .fd = fd, .user_data = slot - ring->slots };
+	ring->sq_array[index] = index;
+
+	return sqe;
+}
+
+static void queue_stat(struct tsvstat_ring* ring, struct tsvstat_slot* slot, int fd, const char* name, int flags)
+{
+	struct io_uring_sqe* sqe = queue_op(ring, slot, SLOT_STAT, fd);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->addr = (uintptr_t)name;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)&slot->stx;
+	sqe->statx_flags = flags;
+}
+
+static void start_slot(struct tsvstat_worker* worker, struct tsvstat_dir* dir, struct tsvstat_slot* slot, const struct dirent64* entry)
+{
+	struct tsvstat_ring* ring = &worker->ring;
+
+	slot->entry = entry;
+	slot->fd = -1;
+
+	// Same sequence as the synchronous path: regular files are opened and stat'ed through the fd, the rest by name.
+	if (entry->d_type == DT_REG)
+		open_slot(ring, dir, slot);
+	else
+		queue_stat(ring, slot, dir->fd, entry->d_name, AT_SYMLINK_NOFOLLOW);
+}
+
+static void open_slot(struct tsvstat_ring* ring, struct tsvstat_dir* dir, struct tsvstat_slot* slot)
+{
+	struct io_uring_sqe* sqe = queue_op(ring, slot, SLOT_OPEN, dir->fd);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->addr = (uintptr_t)slot->entry->d_name;
+	sqe->open_flags = FILE_OPEN_FLAGS;
+	++ring->open_count;
+}
+
+static void complete_slot(struct tsvstat_worker* worker, struct tsvstat_dir* dir, struct tsvstat_slot* slot, int res)
+{
+	struct tsvstat_ring* ring = &worker->ring;
+	const struct dirent64* entry = slot->entry;
+
+	switch (slot->op)
+	{
+		case SLOT_OPEN:
+			if (res >= 0)
+			{
+				slot->fd = res;
+				queue_stat(ring, slot, slot->fd, "", AT_EMPTY_PATH);
+				return;
+			}
+
+			--ring->open_count;
+
+			// Out of fds: the budget shrinks to what is open right now, and the open is retried once some of it is closed.
+			if ((res == -EMFILE || res == -ENFILE) && ring->open_count && !ring->failed)
+			{
+				ring->open_budget = ring->open_count;
+				ring->retry_slots[ring->retry_count++] = slot - ring->slots;
+				return;
+			}
+
+			if (res == -EMFILE || res == -ENFILE)
+			{
+				const char* path = join_path(worker, dir, entry->d_name, strlen(entry->d_name));
+				errno = -res;
+				perror(path ? path : entry->d_name);
+			}
+
+			queue_stat(ring, slot, dir->fd, entry->d_name, AT_SYMLINK_NOFOLLOW);
+			return;
+		case SLOT_STAT:
+			{
+				const char* path = join_path(worker, dir, entry->d_name, strlen(entry->d_name));
+				if (!path)
+					break;
+
+				if (res < 0)
+				{
+					errno = -res;
+					perror(path);
+					break;
+				}
+
+				const struct statx* stx = &slot->stx;
+				struct stat sb = {
+					.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor),
+					.st_ino = stx->stx_ino,
+					.st_mode = stx->stx_mode,
+					.st_nlink = stx->stx_nlink,
+					.st_uid = stx->stx_uid,
+					.st_gid = stx->stx_gid,
+					.st_size = stx->stx_size,
+					.st_atim = { stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec },
+					.st_mtim = { stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec },
+					.st_ctim = { stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec },
+				};
+
+				int fd = slot->fd;
+				slot->fd = record_entry(worker, dir, entry, path, &sb, fd);
+				if (fd == -1 && slot->fd >= 0)
+					++ring->open_count;
+			}
+			break;
+		case SLOT_CLOSE:
+			slot->fd = -1;
+			--ring->open_count;
+			if (ring->open_budget < ring->open_limit)
+				++ring->open_budget;
+			free_slot(ring, slot);
+			return;
+		case SLOT_IDLE:
+			return;
+	}
+
+	if (slot->fd >= 0)
+		queue_op(ring, slot, SLOT_CLOSE, slot->fd)->opcode = IORING_OP_CLOSE;
+	else
+		free_slot(ring, slot);
+}
+
+static int run_slot(const struct tsvstat_dir* dir, struct tsvstat_slot* slot)
+{
+	int res = 0;
+	switch (slot->op)
+	{
+		case SLOT_OPEN:
+			res = openat(dir->fd, slot->entry->d_name, FILE_OPEN_FLAGS);
+			break;
+		case SLOT_STAT:
+			if (slot->fd >= 0)
+				res = statx(slot->fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &slot->stx);
+			else
+				res = statx(dir->fd, slot->entry->d_name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &slot->stx);
+			break;
+		case SLOT_CLOSE:
+			res = close(slot->fd);
+			break;
+		case SLOT_IDLE:
+			break;
+	}
+
+	return res == -1 ? -errno : res;
+}
+
+static void free_slot(struct tsvstat_ring* ring, struct tsvstat_slot* slot)
+{
+	slot->op = SLOT_IDLE;
+	ring->free_slots[ring->free_count++] = slot - ring->slots;
+}
+
+static bool push_dir(struct tsvstat_worker* worker, struct tsvstat_dir* parent, const char* name, size_t name_length)
+{
+	struct tsvstat_state* state = worker->state;
+
+	size_t prefix = 0u;
+	if (parent)
+	{
+		prefix = parent->length;
+		if (parent->path[prefix - 1u] != '/')
+			++prefix;
+	}
+
+	struct tsvstat_dir* dir = malloc(sizeof(struct tsvstat_dir) + prefix + name_length + 1u);
+	if (!dir)
+	{
+		perror("malloc");
+		return false;
+	}
+
+	*dir = (struct tsvstat_dir){ .parent = parent, .fd = -1, .refs = 1u, .name_offset = prefix, .length = prefix + name_length };
+
+	if (parent)
+	{
+		memcpy(dir->path, parent->path, parent->length);
+		dir->path[prefix - 1u] = '/';
+		dir->parent_dev = parent->dev;
+		dir->parent_ino = parent->ino;
+		__atomic_add_fetch(&parent->refs, 1u, __ATOMIC_RELAXED);
+
+		if (state->indexing && !add_entry(worker, NULL, 0u, name, name_length))
+		{
+			release_dir(parent);
+			free(dir);
+			return false;
+		}
+	}
+
+	memcpy(dir->path + prefix, name, name_length);
+	dir->path[dir->length] = '\0';
+
+	if (!queue_dir(worker, dir, false))
+	{
+		release_dir(parent);
+		free(dir);
+		return false;
+	}
+
+	return true;
+}
+
+static bool queue_dir(struct tsvstat_worker* worker, struct tsvstat_dir* dir, bool top)
+{
+	struct tsvstat_state* state = worker->state;
+	struct tsvstat_deque* deque = &worker->deque;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->count == deque->capacity)
+	{
+		size_t capacity = deque->capacity ? deque->capacity * 2u : 0x100u;
+		struct tsvstat_dir** items = malloc(capacity * sizeof(struct tsvstat_dir*));
+		if (!items)
+		{
+			pthread_mutex_unlock(&deque->lock);
+			perror("malloc");
+			return false;
+		}
+
+		for (size_t i = 0u; i < deque->count; ++i)
+			items[i] = deque->items[(deque->head + i) % deque->capacity];
+
+		free(deque->items);
+		deque->items = items;
+		deque->head = 0u;
+		deque->capacity = capacity;
+	}
+
+	__atomic_add_fetch(&state->pending, 1u, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&state->queued, 1u, __ATOMIC_SEQ_CST);
+
+	if (top)
+	{
+		deque->head = (deque->head + deque->capacity - 1u) % deque->capacity;
+		deque->items[deque->head] = dir;
+	}
+	else
+		deque->items[(deque->head + deque->count) % deque->capacity] = dir;
+	++deque->count;
+
+	pthread_mutex_unlock(&deque->lock);
+
+	if (__atomic_load_n(&state->idle_count, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&state->lock);
+		pthread_cond_signal(&state->idle);
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	return true;
+}
+
+static void detach_dirs(struct tsvstat_state* state)
+{
+	// Queued directories fall back to being opened by full path, so their parents' fds can be closed early.
+	for (uint32_t i = 0u; i < state->jobs; ++i)
+	{
+		struct tsvstat_deque* deque = &state->workers[i].deque;
+		pthread_mutex_lock(&deque->lock);
+
+		for (size_t j = 0u; j < deque->count; ++j)
+		{
+			struct tsvstat_dir* dir = deque->items[(deque->head + j) % deque->capacity];
+			release_dir(dir->parent);
+			dir->parent = NULL;
+		}
+
+		pthread_mutex_unlock(&deque->lock);
+	}
+}
+
+static struct tsvstat_dir* next_dir(struct tsvstat_worker* worker)
+{
+	struct tsvstat_state* state = worker->state;
+	struct tsvstat_deque* deque = &worker->deque;
+
+	for (;;)
+	{
+		// Own work is taken depth first from the bottom, which keeps few directory fds open.
+		struct tsvstat_dir* dir = NULL;
+
+		pthread_mutex_lock(&deque->lock);
+		if (deque->count)
+		{
+			--deque->count;
+			dir = deque->items[(deque->head + deque->count) % deque->capacity];
+		}
+		pthread_mutex_unlock(&deque->lock);
+
+		if (!dir)
+			dir = steal_dir(worker);
+
+		if (dir)
+		{
+			__atomic_sub_fetch(&state->queued, 1u, __ATOMIC_SEQ_CST);
+			return dir;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		__atomic_add_fetch(&state->idle_count, 1u, __ATOMIC_SEQ_CST);
+
+		while (__atomic_load_n(&state->pending, __ATOMIC_SEQ_CST) && !__atomic_load_n(&state->queued, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&state->idle, &state->lock);
+
+		__atomic_sub_fetch(&state->idle_count, 1u, __ATOMIC_SEQ_CST);
+		bool done = !__atomic_load_n(&state->pending, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&state->lock);
+
+		if (done)
+			return NULL;
+	}
+}
+
+static struct tsvstat_dir* steal_dir(struct tsvstat_worker* worker)
+{
+	struct tsvstat_state* state = worker->state;
+
+	// Thieves take from the top, where the directories closest to the root, and so the largest subtrees, are.
+	for (uint32_t i = 1u; i < state->jobs; ++i)
+	{
+		worker->victim = (worker->victim + 1u) % state->jobs;
+		if (worker->victim == (uint32_t)(worker - state->workers))
+			continue;
+
+		struct tsvstat_deque* deque = &state->workers[worker->victim].deque;
+		struct tsvstat_dir* dir = NULL;
+
+		pthread_mutex_lock(&deque->lock);
+		if (deque->count)
+		{
+			dir = deque->items[deque->head];
+			deque->head = (deque->head + 1u) % deque->capacity;
+			--deque->count;
+		}
+		pthread_mutex_unlock(&deque->lock);
+
+		if (dir)
+			return dir;
+	}
+
+	return NULL;
+}
+
+static void release_dir(struct tsvstat_dir* dir)
+{
+	while (dir && !__atomic_sub_fetch(&dir->refs, 1u, __ATOMIC_ACQ_REL))
+	{
+		struct tsvstat_dir* parent = dir->parent;
+
+		if (dir->fd >= 0)
+			close(dir->fd);
+
+		free(dir);
+		dir = parent;
+	}
+}
+
+static const char* join_path(struct tsvstat_worker* worker, const struct tsvstat_dir* dir, const char* name, size_t name_length)
+{
+	size_t prefix = dir->length;
+	if (dir->path[prefix - 1u] != '/')
+		++prefix;
+
+	size_t size = prefix + name_length + 1u;
+	if (size > worker->path_capacity)
+	{
+		size_t capacity = worker->path_capacity ? worker->path_capacity : 0x1000u;
+		while (capacity < size)
+			capacity *= 2u;
+
+		char* path = realloc(worker->path, capacity);
+		if (!path)
+		{
+			perror("realloc");
+			return NULL;
+		}
+
+		worker->path = path;
+		worker->path_capacity = capacity;
+	}
+
+	memcpy(worker->path, dir->path, dir->length);
+	worker->path[prefix - 1u] = '/';
+	memcpy(worker->path + prefix, name, name_length + 1u);
+	return worker->path;
+}
+
+static bool emit_record(struct tsvstat_worker* worker, const char* name, const char* path, const struct stat* sb, int extents)
+{
+	struct tsvstat_state* state = worker->state;
+	size_t path_length = strlen(path);
+
+	if (!state->indexing)
+	{
+		char* out = reserve_output(worker, RECORD_MAX_LENGTH + path_length);
+		if (!out)
+			return false;
+
+		out = format_record(out, sb, extents);
+		memcpy(out, path, path_length);
+		out += path_length;
+		*out++ = '\n';
+
+		worker->out_size = out - worker->out;
+		return true;
+	}
+
+	// With a snapshot the record is kept with its directory; in delta mode it is only printed once the directory is compared.
+	char prefix[RECORD_MAX_LENGTH];
+	size_t prefix_length = format_record(prefix, sb, extents) - prefix;
+
+	if (!add_entry(worker, prefix, prefix_length, name, strlen(name)))
+		return false;
+
+	return state->delta || emit_line(worker, 0, prefix, prefix_length, NULL, 0u, path, path_length);
+}
+
+static bool emit_line(struct tsvstat_worker* worker, char change, const char* prefix, size_t prefix_length, const char* base, size_t base_length, const char* name, size_t name_length)
+{
+	char* out = reserve_output(worker, 3u + prefix_length + base_length + name_length);
+	if (!out)
+		return false;
+
+	if (change)
+	{
+		*out++ = change;
+		*out++ = '\t';
+	}
+
+	memcpy(out, prefix, prefix_length);
+	out += prefix_length;
+
+	if (base_length)
+	{
+		memcpy(out, base, base_length);
+		out += base_length;
+
+		if (base[base_length - 1u] != '/')
+			*out++ = '/';
+	}
+
+	memcpy(out, name, name_length);
+	out += name_length;
+	*out++ = '\n';
+
+	worker->out_size = out - worker->out;
+	return true;
+}
+
+static char* reserve_output(struct tsvstat_worker* worker, size_t length)
+{
+	if (worker->out_capacity - worker->out_size < length)
+	{
+		// Unsorted output goes out a buffer at a time; sorted output has to be held until the walk is over.
+		if (!worker->state->sorted)
+			flush_output(worker);
+
+		if (worker->out_capacity - worker->out_size < length)
+		{
+			size_t capacity = worker->out_capacity * 2u;
+			while (capacity - worker->out_size < length)
+				capacity *= 2u;
+
+			char* out = realloc(worker->out, capacity);
+			if (!out)
+			{
+				perror("realloc");
+				return NULL;
+			}
+
+			worker->out = out;
+			worker->out_capacity = capacity;
+		}
+	}
+
+	if (worker->state->sorted)
+	{
+		if (worker->line_count == worker->line_capacity)
+		{
+			size_t capacity = worker->line_capacity ? worker->line_capacity * 2u : 0x1000u;
+			size_t* lines = realloc(worker->lines, capacity * sizeof(size_t));
+			if (!lines)
+			{
+				perror("realloc");
+				return NULL;
+			}
+
+			worker->lines = lines;
+			worker->line_capacity = capacity;
+		}
+
+		worker->lines[worker->line_count++] = worker->out_size;
+	}
+
+	return worker->out + worker->out_size;
+}
+
+static char* format_record(char* out, const struct stat* sb, int extents)
+{
+	// Same conversions as "%ld\t%ld\t%04o\t%lu\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%d\t", without going through printf.
+	out = format_signed(out, sb->st_dev);
+	*out++ = '\t';
+	out = format_signed(out, sb->st_ino);
+	*out++ = '\t';
+	out = format_mode(out, sb->st_mode & ~S_IFMT);
+	*out++ = '\t';
+	out = format_unsigned(out, sb->st_nlink);
+	*out++ = '\t';
+	out = format_signed(out, (int)sb->st_uid);
+	*out++ = '\t';
+	out = format_signed(out, (int)sb->st_gid);
+	*out++ = '\t';
+	out = format_signed(out, sb->st_size);
+	*out++ = '\t';
+	out = format_signed(out, sb->st_atime);
+	*out++ = '\t';
+	out = format_signed(out, sb->st_mtime);
+	*out++ = '\t';
+	out = format_signed(out, sb->st_ctime);
+	*out++ = '\t';
+	out = format_signed(out, extents);
+	*out++ = '\t';
+	return out;
+}
+
+static inline char* format_signed(char* out, long int value)
+{
+	if (value < 0)
+	{
+		*out++ = '-';
+		return format_unsigned(out, -(unsigned long int)value);
+	}
+
+	return format_unsigned(out, value);
+}
+
+static inline char* format_unsigned(char* out, unsigned long int value)
+{
+	static const char digits[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+
+	// Two digits at a time from the end of a scratch buffer, then copied out in one go.
+	char buffer[20];
+	char* end = buffer + sizeof(buffer);
+	char* p = end;
+
+	while (value >= 100u)
+	{
+		unsigned int pair = value % 100u;
+		value /= 100u;
+		p -= 2;
+		memcpy(p, digits + pair * 2u, 2);
+	}
+
+	if (value >= 10u)
+	{
+		p -= 2;
+		memcpy(p, digits + value * 2u, 2);
+	}
+	else
+		*--p = '0' + value;
+
+	size_t length = end - p;
+	memcpy(out, p, length);
+	return out + length;
+}
+
+static inline char* format_mode(char* out, unsigned int mode)
+{
+	// The permission bits never need more than the four digits %04o pads to.
+	out[0] = '0' + (mode >> 9 & 7u);
+	out[1] = '0' + (mode >> 6 & 7u);
+	out[2] = '0' + (mode >> 3 & 7u);
+	out[3] = '0' + (mode & 7u);
+	return out + 4;
+}
+
+static void flush_output(struct tsvstat_worker* worker)
+{
+	write_output(worker->state, worker->out, worker->out_size);
+	worker->out_size = 0u;
+}
+
+static void write_output(struct tsvstat_state* state, const char* data, size_t size)
+{
+	// Whole buffers are written under the lock, so lines from different workers never interleave.
+	pthread_mutex_lock(&state->output);
+
+	while (size)
+	{
+		ssize_t written = write(STDOUT_FILENO, data, size);
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			perror("write");
+			break;
+		}
+
+		data += written;
+		size -= written;
+	}
+
+	pthread_mutex_unlock(&state->output);
+}
+
+static void write_sorted(struct tsvstat_state* state)
+{
+	size_t count = 0u;
+	for (uint32_t i = 0u; i < state->jobs; ++i)
+		count += state->workers[i].line_count;
+
+	struct tsvstat_record* records = malloc(count * sizeof(struct tsvstat_record) + 1u);
+	if (!records)
+	{
+		perror("malloc");
+		return;
+	}
+
+	// Names may contain newlines or tabs, so records are delimited by the offsets kept while formatting.
+	struct tsvstat_record* record = records;
+	for (uint32_t i = 0u; i < state->jobs; ++i)
+	{
+		const struct tsvstat_worker* worker = state->workers + i;
+		for (size_t j = 0u; j < worker->line_count; ++j, ++record)
+		{
+			size_t end = j + 1u < worker->line_count ? worker->lines[j + 1u] : worker->out_size;
+			record->line = worker->out + worker->lines[j];
+			record->length = end - worker->lines[j];
+
+			const char* name = record->line;
+			for (int k = state->delta ? -1 : 0; k < 11; ++k)
+				name = (const char*)memchr(name, '\t', record->line + record->length - name) + 1;
+
+			record->name = name;
+			record->name_length = record->line + record->length - 1 - name;
+		}
+	}
+
+	qsort(records, count, sizeof(struct tsvstat_record), compare_records);
+
+	// Records are gathered into large writes rather than written one at a time.
+	char* out = malloc(OUTPUT_BUFFER_SIZE);
+	if (!out)
+	{
+		perror("malloc");
+		free(records);
+		return;
+	}
+
+	size_t size = 0u;
+	for (size_t i = 0u; i < count; ++i)
+	{
+		if (OUTPUT_BUFFER_SIZE - size < records[i].length)
+		{
+			write_output(state, out, size);
+			size = 0u;
+		}
+
+		if (records[i].length > OUTPUT_BUFFER_SIZE)
+			write_output(state, records[i].line, records[i].length);
+		else
+		{
+			memcpy(out + size, records[i].line, records[i].length);
+			size += records[i].length;
+		}
+	}
+
+	write_output(state, out, size);
+
+	free(out);
+	free(records);
+}
+
+static int compare_records(const void* a, const void* b)
+{
+	const struct tsvstat_record* ra = a;
+	const struct tsvstat_record* rb = b;
+
+	int result = memcmp(ra->name, rb->name, ra->name_length < rb->name_length ? ra->name_length : rb->name_length);
+	if (result)
+		return result;
+
+	if (ra->name_length != rb->name_length)
+		return ra->name_length < rb->name_length ? -1 : 1;
+
+	result = memcmp(ra->line, rb->line, ra->length < rb->length ? ra->length : rb->length);
+	if (result)
+		return result;
+
+	return (ra->length > rb->length) - (ra->length < rb->length);
+}
+
+static int try_get_extent_count(int fd, const struct stat* sb)
+{
+	if (S_ISREG(sb->st_mode) && !sb->st_size)
+		return 0;
+
+	if (fd == -1 || !S_ISREG(sb->st_mode))
+		return -1;
+
+	struct fiemap fm = { .fm_length = sb->st_size };
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) == -1)
+	{
+		perror("ioctl");
+		return -1;
+	}
+
+	return fm.fm_mapped_extents;
+}
+
+static void cleanup(struct tsvstat_state* state)
+{
+	if (state->workers)
+	{
+		for (uint32_t i = 0u; i < state->jobs; ++i)
+		{
+			struct tsvstat_worker* worker = state->workers + i;
+
+			if (worker->started)
+				pthread_join(worker->thread, NULL);
+
+			// Whatever is still queued after a failure owns a reference to its parent.
+			for (size_t j = 0u; j < worker->deque.count; ++j)
+				release_dir(worker->deque.items[(worker->deque.head + j) % worker->deque.capacity]);
+
+			free(worker->deque.items);
+			free(worker->dirents);
+			free(worker->path);
+			free(worker->out);
+			free(worker->lines);
+			free(worker->dirs);
+			free(worker->data);
+			free(worker->entries);
+			free(worker->chain);
+			free(worker->old_path);
+
+			if (worker->state)
+				close_ring(&worker->ring);
+		}
+
+		free(state->workers);
+	}
+
+	if (state->snapshot)
+		munmap(state->snapshot, state->snapshot_size);
+
+	free(state->visited);
+
+	if (state->save_fd >= 0)
+		close(state->save_fd);
+
+	if (state->save_temp)
+	{
+		unlink(state->save_temp);
+		free(state->save_temp);
+	}
 }